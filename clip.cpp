@@ -35,9 +35,18 @@
 #include <sstream>
 #include <cinttypes>
 #include <limits>
+#include <mutex>
 
 //#define CLIP_DEBUG_FUNCTIONS
 
+// with LLAVA_ISA_DISPATCH the hot preprocessing loops are compiled once per ISA level
+// and the dynamic loader picks the clone matching the CPU at startup
+#if defined(LLAVA_ISA_DISPATCH) && defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define CLIP_ISA_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define CLIP_ISA_CLONES
+#endif
+
 // RGB uint8 image
 struct clip_image_u8 {
     int nx;
@@ -127,6 +136,9 @@ static std::string format(const char * fmt, ...) {
 #define TN_MVLM_PROJ_PEG   "mm.model.peg.%d.%s"
 #define TN_IMAGE_NEWLINE   "model.image_newline"
 
+// KV length alignment required by the flash attention kernels of the GPU backends
+#define CLIP_FATTN_KV_PAD  256
+
 
 enum projector_type {
     PROJECTOR_TYPE_MLP,
@@ -512,19 +524,87 @@ struct clip_ctx {
     bool has_post_norm = false;
     bool has_patch_bias = false;
 
+    // fused attention: K/V are cast to F16 and the KQ matrix is never materialized
+    bool use_flash_attn = false;
+
+    // stride == kernel size, so the patch embedding is a plain GEMM over pre-gathered patches
+    bool use_patch_gemm = false;
+
     struct gguf_context * ctx_gguf;
     struct ggml_context * ctx_data;
 
-    std::vector<uint8_t> buf_compute_meta;
-
-    // memory buffers to evaluate the model
+    // the weights, read-only once loaded and shared by all states
     ggml_backend_buffer_t params_buffer  = NULL;
+    ggml_backend_t backend       = NULL;
+
+    // used by the calls without an explicit state
+    struct clip_state * state = NULL;
+
+    // FNV-1a over the tensor names, sizes and leading bytes, see clip_model_fingerprint
+    uint64_t fingerprint = 0xcbf29ce484222325ULL;
+
+    // compute time per block (or block/op) summed over the encodes of all states, in graph
+    // order, see clip_set_profile
+    clip_profile_mode profile_mode = CLIP_PROFILE_NONE;
+    mutable std::mutex profile_mutex;
+    mutable std::vector<clip_profile_entry> profile;
+    mutable std::map<std::string, size_t> profile_index;
+};
+
+// What one encode needs besides the weights: graph metadata, compute buffers and a backend
+// instance of its own for the thread count and abort callback. Encodes on different states
+// can run at the same time.
+struct clip_state {
+    std::vector<uint8_t> buf_compute_meta;
 
     ggml_backend_t backend       = NULL;
     ggml_gallocr_t compute_alloc = NULL;
 };
 
-static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32_batch * imgs) {
+static uint64_t clip_fnv1a(uint64_t hash, const void * data, size_t size) {
+    const uint8_t * bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static ggml_backend_t clip_backend_init() {
+    ggml_backend_t backend = NULL;
+
+#ifdef GGML_USE_CUDA
+    backend = ggml_backend_cuda_init(0);
+#endif
+
+#ifdef GGML_USE_METAL
+    backend = ggml_backend_metal_init();
+#endif
+
+#ifdef GGML_USE_CANN
+    backend = ggml_backend_cann_init(0);
+#endif
+
+    if (!backend) {
+        backend = ggml_backend_cpu_init();
+    }
+    return backend;
+}
+
+// the MLP projectors work row by row, so several images can share one graph; the LDP ones
+// pool over the 2D patch grid of a single image
+static bool clip_projector_batches(const clip_ctx * ctx) {
+    return ctx->proj_type == PROJECTOR_TYPE_MLP || ctx->proj_type == PROJECTOR_TYPE_MLP_NORM;
+}
+
+// the profiler times the nodes up to and including each marked node as one block
+#define CLIP_PROFILE_MARK "profile:"
+
+static void clip_profile_mark(struct ggml_tensor * cur, const char * block) {
+    ggml_format_name(cur, CLIP_PROFILE_MARK "%s", block);
+}
+
+static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, clip_state * state, const clip_image_f32_batch * imgs) {
     if (!ctx->has_vision_encoder) {
         LOG_TEE("This gguf file seems to have no vision encoder\n");
         return nullptr;
@@ -547,26 +627,39 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     const int batch_size = imgs->size;
 
     if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1);
+        GGML_ASSERT(batch_size == 1 || clip_projector_batches(ctx));
     }
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ ctx->buf_compute_meta.size(),
-        /*.mem_buffer =*/ ctx->buf_compute_meta.data(),
+        /*.mem_size   =*/ state->buf_compute_meta.size(),
+        /*.mem_buffer =*/ state->buf_compute_meta.data(),
         /*.no_alloc   =*/ true,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
     struct ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * inp_raw = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, image_size, image_size, 3, batch_size);
-    ggml_set_name(inp_raw, "inp_raw");
-    ggml_set_input(inp_raw);
+    struct ggml_tensor * inp = nullptr;
+    if (ctx->use_patch_gemm) {
+        // each row holds one patch in kernel order (x, y, channel), see clip_image_to_patches()
+        struct ggml_tensor * inp_patches = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, patch_size * patch_size * 3, num_patches, batch_size);
+        ggml_set_name(inp_patches, "inp_patches");
+        ggml_set_input(inp_patches);
+
+        struct ggml_tensor * kernel = ggml_reshape_2d(ctx0, model.patch_embeddings, patch_size * patch_size * 3, hidden_size);
 
-    struct ggml_tensor * inp = ggml_conv_2d(ctx0, model.patch_embeddings, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
+        // [hidden_size, num_patches, batch_size]
+        inp = ggml_mul_mat(ctx0, kernel, inp_patches);
+    } else {
+        struct ggml_tensor * inp_raw = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, image_size, image_size, 3, batch_size);
+        ggml_set_name(inp_raw, "inp_raw");
+        ggml_set_input(inp_raw);
+
+        inp = ggml_conv_2d(ctx0, model.patch_embeddings, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
 
-    inp = ggml_reshape_3d(ctx0, inp, num_patches, hidden_size, batch_size);
-    inp = ggml_cont(ctx0, ggml_permute(ctx0, inp, 1, 0, 2, 3));
+        inp = ggml_reshape_3d(ctx0, inp, num_patches, hidden_size, batch_size);
+        inp = ggml_cont(ctx0, ggml_permute(ctx0, inp, 1, 0, 2, 3));
+    }
 
     if (ctx->has_patch_bias) {
         // inp = ggml_add(ctx0, inp, ggml_repeat(ctx0, model.patch_bias, inp));
@@ -579,8 +672,10 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
         embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
         ggml_set_name(embeddings, "embeddings");
         ggml_set_input(embeddings);
-        embeddings = ggml_acc(ctx0, embeddings, model.class_embedding,
-                embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], 0);
+        for (int b = 0; b < batch_size; b++) {
+            embeddings = ggml_acc(ctx0, embeddings, model.class_embedding,
+                    embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], b * embeddings->nb[2]);
+        }
         embeddings = ggml_acc(ctx0, embeddings, inp,
                 embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
     }
@@ -600,6 +695,14 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
         embeddings = ggml_add(ctx0, ggml_mul(ctx0, embeddings, model.pre_ln_w), model.pre_ln_b);
     }
+    clip_profile_mark(embeddings, "patch_embd");
+
+    struct ggml_tensor * kq_mask = nullptr;
+    if (ctx->use_flash_attn && !ggml_backend_is_cpu(state->backend)) {
+        kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, GGML_PAD(num_positions, CLIP_FATTN_KV_PAD), GGML_PAD(num_positions, GGML_KQ_MASK_PAD));
+        ggml_set_name(kq_mask, "kq_mask");
+        ggml_set_input(kq_mask);
+    }
 
     // loop over layers
     for (int il = 0; il < n_layer - 1; il++) {
@@ -616,7 +719,34 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
         }
 
         // self-attention
-        {
+        if (ctx->use_flash_attn) {
+            struct ggml_tensor * Q =
+                ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].q_w, cur), model.layers[il].q_b);
+            struct ggml_tensor * K =
+                ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].k_w, cur), model.layers[il].k_b);
+            struct ggml_tensor * V =
+                ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].v_w, cur), model.layers[il].v_b);
+
+            // [d_head, num_positions, n_head, batch_size]
+            Q = ggml_permute(ctx0, ggml_reshape_4d(ctx0, Q, d_head, n_head, num_positions, batch_size), 0, 2, 1, 3);
+            K = ggml_permute(ctx0, ggml_reshape_4d(ctx0, K, d_head, n_head, num_positions, batch_size), 0, 2, 1, 3);
+            V = ggml_permute(ctx0, ggml_reshape_4d(ctx0, V, d_head, n_head, num_positions, batch_size), 0, 2, 1, 3);
+
+            if (kq_mask) {
+                // GPU kernels need the KV length padded, the mask hides the padding
+                K = ggml_pad(ctx0, ggml_cont(ctx0, K), 0, kq_mask->ne[0] - num_positions, 0, 0);
+                V = ggml_pad(ctx0, ggml_cont(ctx0, V), 0, kq_mask->ne[0] - num_positions, 0, 0);
+            }
+
+            K = ggml_cast(ctx0, K, GGML_TYPE_F16);
+            V = ggml_cast(ctx0, V, GGML_TYPE_F16);
+
+            // result is [d_head, n_head, num_positions, batch_size]
+            cur = ggml_flash_attn_ext(ctx0, Q, K, V, kq_mask, 1.0f / sqrtf((float)d_head), 0.0f, 0.0f);
+            ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
+
+            cur = ggml_reshape_3d(ctx0, cur, hidden_size, num_positions, batch_size);
+        } else {
 
             struct ggml_tensor * Q =
                 ggml_add(ctx0, ggml_mul_mat(ctx0, model.layers[il].q_w, cur), model.layers[il].q_b);
@@ -654,6 +784,7 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
         // re-add the layer input, e.g., residual
         cur = ggml_add(ctx0, cur, embeddings);
+        clip_profile_mark(cur, format("layer.%02d.attn", il).c_str());
 
         embeddings = cur; // embeddings = residual, cur = hidden_states
 
@@ -678,6 +809,7 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
         // residual 2
         cur = ggml_add(ctx0, embeddings, cur);
+        clip_profile_mark(cur, format("layer.%02d.ffn", il).c_str());
 
         embeddings = cur;
     }
@@ -688,13 +820,15 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
         ggml_set_name(embeddings, "post_ln");
 
         embeddings = ggml_add(ctx0, ggml_mul(ctx0, embeddings, model.post_ln_w), model.post_ln_b);
+        clip_profile_mark(embeddings, "post_ln");
     }
 
     // llava projector
     {
-        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1]);
+        // the images of a batch one after the other: [hidden_size, num_positions * batch_size]
+        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1] * embeddings->ne[2]);
 
-        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches);
+        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches * batch_size);
         ggml_set_name(patches, "patches");
         ggml_set_input(patches);
 
@@ -871,6 +1005,7 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
         else {
             GGML_ABORT("fatal error");
         }
+        clip_profile_mark(embeddings, "projector");
     }
 
     // build the graph
@@ -881,8 +1016,41 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     return gf;
 }
 
-// read and create ggml_context containing the tensors and their data
+static clip_state * clip_state_new() {
+    clip_state * state = new clip_state();
+    state->buf_compute_meta.resize(GGML_DEFAULT_GRAPH_SIZE * ggml_tensor_overhead() + ggml_graph_overhead());
+    state->backend = clip_backend_init();
+    state->compute_alloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(state->backend));
+    return state;
+}
+
+// sized for one image, larger batches grow the compute buffer on first use
+static size_t clip_state_reserve(const clip_ctx * ctx, clip_state * state) {
+    clip_image_f32_batch batch;
+    batch.size = 1;
+    ggml_cgraph * gf = clip_image_build_graph(ctx, state, &batch);
+    ggml_gallocr_reserve(state->compute_alloc, gf);
+    return ggml_gallocr_get_buffer_size(state->compute_alloc, 0);
+}
+
+struct clip_model_params clip_model_default_params(void) {
+    struct clip_model_params params = {
+        /*.verbosity      =*/ 1,
+        /*.use_flash_attn =*/ false,
+    };
+    return params;
+}
+
 struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
+    struct clip_model_params params = clip_model_default_params();
+    params.verbosity = verbosity;
+    return clip_model_load_with_params(fname, params);
+}
+
+// read and create ggml_context containing the tensors and their data
+struct clip_ctx * clip_model_load_with_params(const char * fname, struct clip_model_params model_params) {
+    const int verbosity = model_params.verbosity;
+
     struct ggml_context * meta = NULL;
 
     struct gguf_init_params params = {
@@ -995,26 +1163,8 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
         }
     }
 
-#ifdef GGML_USE_CUDA
-    new_clip->backend = ggml_backend_cuda_init(0);
-    LOG_TEE("%s: CLIP using CUDA backend\n", __func__);
-#endif
-
-#ifdef GGML_USE_METAL
-    new_clip->backend = ggml_backend_metal_init();
-    LOG_TEE("%s: CLIP using Metal backend\n", __func__);
-#endif
-
-#ifdef GGML_USE_CANN
-    new_clip->backend = ggml_backend_cann_init(0);
-    LOG_TEE("%s: CLIP using CANN backend\n", __func__);
-#endif
-
-
-    if (!new_clip->backend) {
-        new_clip->backend = ggml_backend_cpu_init();
-        LOG_TEE("%s: CLIP using CPU backend\n", __func__);
-    }
+    new_clip->backend = clip_backend_init();
+    LOG_TEE("%s: CLIP using %s backend\n", __func__, ggml_backend_name(new_clip->backend));
 
     // model size and capabilities
     {
@@ -1082,6 +1232,7 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
 
         // alloc memory and offload data
         new_clip->params_buffer = ggml_backend_alloc_ctx_tensors(new_clip->ctx_data, new_clip->backend);
+        const size_t fingerprint_bytes = 64 * 1024; // per tensor, enough to tell trainings apart
         for (int i = 0; i < n_tensors; ++i) {
             const char * name = gguf_get_tensor_name(ctx, i);
             struct ggml_tensor * cur = ggml_get_tensor(new_clip->ctx_data, name);
@@ -1094,15 +1245,21 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
                 return nullptr;
             }
             int num_bytes = ggml_nbytes(cur);
+            const void * data;
             if (ggml_backend_buffer_is_host(new_clip->params_buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
+                data = cur->data;
             } else {
                 // read into a temporary buffer first, then copy to device memory
                 read_buf.resize(num_bytes);
                 fin.read(reinterpret_cast<char *>(read_buf.data()), num_bytes);
                 ggml_backend_tensor_set(cur, read_buf.data(), 0, num_bytes);
+                data = read_buf.data();
             }
+            new_clip->fingerprint = clip_fnv1a(new_clip->fingerprint, name, strlen(name));
+            new_clip->fingerprint = clip_fnv1a(new_clip->fingerprint, &num_bytes, sizeof(num_bytes));
+            new_clip->fingerprint = clip_fnv1a(new_clip->fingerprint, data, std::min<size_t>(num_bytes, fingerprint_bytes));
         }
         fin.close();
     }
@@ -1212,6 +1369,10 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
         try {
             vision_model.patch_embeddings    = get_tensor(new_clip->ctx_data, TN_PATCH_EMBD);
             vision_model.position_embeddings = get_tensor(new_clip->ctx_data, format(TN_POS_EMBD, "v"));
+
+            // quantized kernels cannot be viewed as rows of patch_size*patch_size*3 elements
+            new_clip->use_patch_gemm = vision_model.patch_embeddings->type == GGML_TYPE_F32 ||
+                                       vision_model.patch_embeddings->type == GGML_TYPE_F16;
         } catch(const std::exception& /*e*/) {
             LOG_TEE("%s: failed to load vision model tensors\n", __func__);
         }
@@ -1315,19 +1476,44 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
 
     // measure mem requirement and allocate
     {
-        new_clip->buf_compute_meta.resize(GGML_DEFAULT_GRAPH_SIZE * ggml_tensor_overhead() + ggml_graph_overhead());
-        new_clip->compute_alloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(new_clip->backend));
+        new_clip->state = clip_state_new();
         clip_image_f32_batch batch;
         batch.size = 1;
-        ggml_cgraph * gf = clip_image_build_graph(new_clip, &batch);
-        ggml_gallocr_reserve(new_clip->compute_alloc, gf);
-        size_t compute_memory_buffer_size = ggml_gallocr_get_buffer_size(new_clip->compute_alloc, 0);
+
+        new_clip->use_flash_attn = model_params.use_flash_attn;
+        if (new_clip->use_flash_attn) {
+            ggml_cgraph * gf = clip_image_build_graph(new_clip, new_clip->state, &batch);
+            for (int i = 0; i < gf->n_nodes; i++) {
+                if (gf->nodes[i]->op == GGML_OP_FLASH_ATTN_EXT && !ggml_backend_supports_op(new_clip->backend, gf->nodes[i])) {
+                    LOG_TEE("%s: flash attention not supported by the %s backend, using the default attention\n", __func__, ggml_backend_name(new_clip->backend));
+                    new_clip->use_flash_attn = false;
+                    break;
+                }
+            }
+        }
+        LOG_TEE("%s: flash attention: %s\n", __func__, new_clip->use_flash_attn ? "enabled" : "disabled");
+
+        size_t compute_memory_buffer_size = clip_state_reserve(new_clip, new_clip->state);
         LOG_TEE("%s: compute allocated memory: %.2f MB\n", __func__, compute_memory_buffer_size /1024.0/1024.0);
     }
 
     return new_clip;
 }
 
+struct clip_state * clip_state_init(const struct clip_ctx * ctx) {
+    clip_state * state = clip_state_new();
+    clip_state_reserve(ctx, state);
+    return state;
+}
+
+void clip_state_free(struct clip_state * state) {
+    if (state) {
+        ggml_gallocr_free(state->compute_alloc);
+        ggml_backend_free(state->backend);
+        delete state;
+    }
+}
+
 struct clip_image_u8 * clip_image_u8_init() {
     return new clip_image_u8();
 }
@@ -1382,11 +1568,16 @@ bool clip_image_load_from_bytes(const unsigned char * bytes, size_t bytes_length
     return true;
 }
 
+void clip_image_load_from_pixels(const unsigned char * rgb, int nx, int ny, struct clip_image_u8 * img) {
+    build_clip_img_from_data(rgb, nx, ny, img);
+}
+
 // Linear interpolation between two points
 inline float clip_lerp(float s, float e, float t) {
     return s + (e - s) * t;
 }
 // Bilinear resize function
+CLIP_ISA_CLONES
 static void bilinear_resize(const clip_image_u8& src, clip_image_u8& dst, int target_width, int target_height) {
     dst.nx = target_width;
     dst.ny = target_height;
@@ -1422,6 +1613,7 @@ static void bilinear_resize(const clip_image_u8& src, clip_image_u8& dst, int ta
 }
 
 // Normalize image to float32 - careful with pytorch .to(model.device, dtype=torch.float16) - this sometimes reduces precision (32>16>32), sometimes not
+CLIP_ISA_CLONES
 static void normalize_image_u8_to_f32(const clip_image_u8* src, clip_image_f32* dst, const float mean[3], const float std[3]) {
     dst->nx = src->nx;
     dst->ny = src->ny;
@@ -1437,6 +1629,7 @@ inline float clip(float x, float lower, float upper) {
     return std::max(lower, std::min(x, upper));
 }
 
+CLIP_ISA_CLONES
 static bool bicubic_resize(const clip_image_u8 &img, clip_image_u8 &dst, int target_width, int target_height) {
     const int nx = img.nx;
     const int ny = img.ny;
@@ -1779,12 +1972,16 @@ void clip_free(clip_ctx * ctx) {
     ggml_free(ctx->ctx_data);
     gguf_free(ctx->ctx_gguf);
 
+    clip_state_free(ctx->state);
     ggml_backend_buffer_free(ctx->params_buffer);
     ggml_backend_free(ctx->backend);
-    ggml_gallocr_free(ctx->compute_alloc);
     delete ctx;
 }
 
+uint64_t clip_model_fingerprint(const struct clip_ctx * ctx) {
+    return ctx->fingerprint;
+}
+
 size_t clip_embd_nbytes(const struct clip_ctx * ctx) {
     return clip_n_patches(ctx) * clip_n_mmproj_embd(ctx) * sizeof(float);
 }
@@ -1833,20 +2030,158 @@ bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, clip_image_f3
     return clip_image_batch_encode(ctx, n_threads, &imgs, vec);
 }
 
+// NHWC -> NCHW, the input layout of ggml_conv_2d
+CLIP_ISA_CLONES
+static void clip_image_to_chw(const clip_image_f32 & img, float * dst) {
+    const int nx = img.nx;
+    const int ny = img.ny;
+    const int n  = nx * ny;
+
+    for (int k = 0; k < 3; k++) {
+        for (int y = 0; y < ny; y++) {
+            for (int x = 0; x < nx; x++) {
+                dst[k * n + y * nx + x] = img.buf[3 * (y * nx + x) + k];
+            }
+        }
+    }
+}
+
+// NHWC -> one contiguous row per (non-overlapping) patch, in the element order of the flattened conv kernel:
+// dst[patch][c][ky][kx], patches in row-major order over the image
+CLIP_ISA_CLONES
+static void clip_image_to_patches(const clip_image_f32 & img, int patch_size, float * dst) {
+    const int nx = img.nx;
+    const int n_patches_x = img.nx / patch_size;
+    const int n_patches_y = img.ny / patch_size;
+    const int n_per_patch = patch_size * patch_size * 3;
+    const int n_per_chan  = patch_size * patch_size;
+
+    // walk the source row by row so the reads stay sequential
+    for (int y = 0; y < n_patches_y * patch_size; y++) {
+        const int py = y / patch_size;
+        const int ky = y % patch_size;
+        const float * src_row = img.buf.data() + 3 * y * nx;
+
+        for (int px = 0; px < n_patches_x; px++) {
+            float * patch = dst + (py * n_patches_x + px) * n_per_patch + ky * patch_size;
+            const float * src = src_row + 3 * px * patch_size;
+
+            for (int kx = 0; kx < patch_size; kx++) {
+                patch[0 * n_per_chan + kx] = src[3 * kx + 0];
+                patch[1 * n_per_chan + kx] = src[3 * kx + 1];
+                patch[2 * n_per_chan + kx] = src[3 * kx + 2];
+            }
+        }
+    }
+}
+
+static bool clip_is_view_op(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_RESHAPE || op == GGML_OP_VIEW || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+// Computes gf one block (or one node) at a time through graph views, the way ggml_backend_sched
+// splits graphs, and adds the wall time of each piece to the ctx's profile
+static ggml_status clip_graph_compute_profiled(const clip_ctx * ctx, clip_state * state, ggml_cgraph * gf) {
+    const int n_nodes = gf->n_nodes;
+
+    // a node belongs to the block of the next marked node
+    std::vector<const char *> block(n_nodes);
+    const char * label = "projector";
+    for (int i = n_nodes - 1; i >= 0; i--) {
+        const char * name = ggml_get_name(gf->nodes[i]);
+        if (strncmp(name, CLIP_PROFILE_MARK, strlen(CLIP_PROFILE_MARK)) == 0) {
+            label = name + strlen(CLIP_PROFILE_MARK);
+        }
+        block[i] = label;
+    }
+
+    // per graph first, so the counts are encodes and max_us is the slowest encode
+    std::vector<std::pair<std::string, int64_t>> times;
+    for (int i0 = 0; i0 < n_nodes; ) {
+        int i1 = i0 + 1;
+        if (ctx->profile_mode == CLIP_PROFILE_NODES) {
+            // views cost nothing, they are timed with the next node
+            while (i1 < n_nodes && clip_is_view_op(gf->nodes[i1 - 1]->op) && block[i1] == block[i0]) {
+                i1++;
+            }
+        } else {
+            while (i1 < n_nodes && block[i1] == block[i0]) {
+                i1++;
+            }
+        }
+
+        std::string name = block[i0];
+        if (ctx->profile_mode == CLIP_PROFILE_NODES) {
+            name += "/";
+            name += ggml_op_desc(gf->nodes[i1 - 1]);
+        }
+
+        ggml_cgraph view = ggml_graph_view(gf, i0, i1);
+        const int64_t t_start_us = ggml_time_us();
+        const ggml_status status = ggml_backend_graph_compute(state->backend, &view);
+        if (status != GGML_STATUS_SUCCESS) {
+            return status;
+        }
+        const int64_t t_us = ggml_time_us() - t_start_us;
+
+        if (!times.empty() && times.back().first == name) {
+            times.back().second += t_us;
+        } else {
+            auto it = std::find_if(times.begin(), times.end(), [&name](const std::pair<std::string, int64_t> & t) { return t.first == name; });
+            if (it != times.end()) {
+                it->second += t_us;
+            } else {
+                times.push_back({name, t_us});
+            }
+        }
+        i0 = i1;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->profile_mutex);
+    for (const auto & t : times) {
+        auto it = ctx->profile_index.find(t.first);
+        if (it == ctx->profile_index.end()) {
+            clip_profile_entry entry = {};
+            snprintf(entry.name, sizeof(entry.name), "%s", t.first.c_str());
+            it = ctx->profile_index.emplace(t.first, ctx->profile.size()).first;
+            ctx->profile.push_back(entry);
+        }
+        clip_profile_entry & entry = ctx->profile[it->second];
+        entry.n_calls  += 1;
+        entry.total_us += t.second;
+        entry.max_us    = std::max(entry.max_us, t.second);
+    }
+    return GGML_STATUS_SUCCESS;
+}
+
 bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec) {
+    return clip_image_batch_encode_with_state(ctx, ctx->state, n_threads, imgs, vec);
+}
+
+bool clip_image_batch_encode_with_state(const clip_ctx * ctx, clip_state * state, const int n_threads, const clip_image_f32_batch * imgs, float * vec) {
     if (!ctx->has_vision_encoder) {
         LOG_TEE("This gguf file seems to have no vision encoder\n");
         return false;
     }
 
     int batch_size = imgs->size;
-    if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1); // TODO: support multiple images
+    if (ctx->has_llava_projector && batch_size > 1 && !clip_projector_batches(ctx)) {
+        // one graph per image, the embeddings still end up back to back in vec
+        const size_t n_per_image = (size_t)clip_n_patches(ctx) * clip_n_mmproj_embd(ctx);
+        for (int b = 0; b < batch_size; b++) {
+            clip_image_f32_batch img{};
+            img.size = 1;
+            img.data = &imgs->data[b];
+            if (!clip_image_batch_encode_with_state(ctx, state, n_threads, &img, vec + b * n_per_image)) {
+                return false;
+            }
+        }
+        return true;
     }
 
     // build the inference graph
-    ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    ggml_gallocr_alloc_graph(ctx->compute_alloc, gf);
+    ggml_cgraph * gf = clip_image_build_graph(ctx, state, imgs);
+    ggml_gallocr_alloc_graph(state->compute_alloc, gf);
 
     // set inputs
     const auto & model = ctx->vision_model;
@@ -1858,27 +2193,21 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     const int num_positions = num_patches + (ctx->has_class_embedding ? 1 : 0);
 
     {
-        struct ggml_tensor * inp_raw = ggml_graph_get_tensor(gf, "inp_raw");
-        float * data = (float *)malloc(ggml_nbytes(inp_raw));
-
-        for (size_t i = 0; i < imgs->size; i++) {
-            const int nx = imgs->data[i].nx;
-            const int ny = imgs->data[i].ny;
-            GGML_ASSERT(nx == image_size && ny == image_size);
-
-            const int n = nx * ny;
-
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].buf[3 * (y * nx + x) + k];
-                        }
-                    }
-                }
+        struct ggml_tensor * inp = ctx->use_patch_gemm ? ggml_graph_get_tensor(gf, "inp_patches") : ggml_graph_get_tensor(gf, "inp_raw");
+        float * data = (float *)malloc(ggml_nbytes(inp));
+
+        const size_t n_per_image = ggml_nelements(inp) / batch_size;
+
+        for (int b = 0; b < batch_size; b++) {
+            GGML_ASSERT(imgs->data[b].nx == image_size && imgs->data[b].ny == image_size);
+
+            if (ctx->use_patch_gemm) {
+                clip_image_to_patches(imgs->data[b], patch_size, data + b * n_per_image);
+            } else {
+                clip_image_to_chw(imgs->data[b], data + b * n_per_image);
             }
         }
-        ggml_backend_tensor_set(inp_raw, data, 0, ggml_nbytes(inp_raw));
+        ggml_backend_tensor_set(inp, data, 0, ggml_nbytes(inp));
         free(data);
     }
 
@@ -1904,27 +2233,49 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         free(positions_data);
     }
 
+    {
+        struct ggml_tensor * kq_mask = ggml_graph_get_tensor(gf, "kq_mask");
+        if (kq_mask) {
+            // every query row sees the same keys, only the padding is masked out
+            std::vector<ggml_fp16_t> mask_data(ggml_nelements(kq_mask));
+            const ggml_fp16_t zero    = ggml_fp32_to_fp16(0.0f);
+            const ggml_fp16_t neg_inf = ggml_fp32_to_fp16(-INFINITY);
+            for (int64_t i1 = 0; i1 < kq_mask->ne[1]; i1++) {
+                for (int64_t i0 = 0; i0 < kq_mask->ne[0]; i0++) {
+                    mask_data[i1 * kq_mask->ne[0] + i0] = i0 < num_positions ? zero : neg_inf;
+                }
+            }
+            ggml_backend_tensor_set(kq_mask, mask_data.data(), 0, ggml_nbytes(kq_mask));
+        }
+    }
+
     {
         struct ggml_tensor * patches = ggml_graph_get_tensor(gf, "patches");
         int* patches_data = (int*)malloc(ggml_nbytes(patches));
-        for (int i = 0; i < num_patches; i++) {
-            patches_data[i] = i + 1;
+        for (int b = 0; b < batch_size; b++) {
+            for (int i = 0; i < num_patches; i++) {
+                patches_data[b * num_patches + i] = b * num_positions + i + 1;
+            }
         }
         ggml_backend_tensor_set(patches, patches_data, 0, ggml_nbytes(patches));
         free(patches_data);
     }
 
-    if (ggml_backend_is_cpu(ctx->backend)) {
-        ggml_backend_cpu_set_n_threads(ctx->backend, n_threads);
+    if (ggml_backend_is_cpu(state->backend)) {
+        ggml_backend_cpu_set_n_threads(state->backend, n_threads);
     }
 
 #ifdef GGML_USE_METAL
-    if (ggml_backend_is_metal(ctx->backend)) {
-        ggml_backend_metal_set_n_cb(ctx->backend, n_threads);
+    if (ggml_backend_is_metal(state->backend)) {
+        ggml_backend_metal_set_n_cb(state->backend, n_threads);
     }
 #endif
 
-    ggml_backend_graph_compute(ctx->backend, gf);
+    const ggml_status status = ctx->profile_mode == CLIP_PROFILE_NONE ? ggml_backend_graph_compute(state->backend, gf)
+                                                                      : clip_graph_compute_profiled(ctx, state, gf);
+    if (status != GGML_STATUS_SUCCESS) {
+        return false; // aborted through clip_set_abort_callback
+    }
 
     // the last node is the embedding tensor
     struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 1];
@@ -1935,6 +2286,35 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     return true;
 }
 
+void clip_set_profile(struct clip_ctx * ctx, enum clip_profile_mode mode) {
+    ctx->profile_mode = mode;
+}
+
+int clip_profile_get(const struct clip_ctx * ctx, struct clip_profile_entry * entries, int n_max) {
+    std::lock_guard<std::mutex> lock(ctx->profile_mutex);
+    const int n = (int) ctx->profile.size();
+    for (int i = 0; i < n && i < n_max; i++) {
+        entries[i] = ctx->profile[i];
+    }
+    return n;
+}
+
+void clip_profile_reset(struct clip_ctx * ctx) {
+    std::lock_guard<std::mutex> lock(ctx->profile_mutex);
+    ctx->profile.clear();
+    ctx->profile_index.clear();
+}
+
+void clip_set_abort_callback(struct clip_ctx * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
+    clip_state_set_abort_callback(ctx->state, abort_callback, abort_callback_data);
+}
+
+void clip_state_set_abort_callback(struct clip_state * state, bool (*abort_callback)(void * data), void * abort_callback_data) {
+    if (ggml_backend_is_cpu(state->backend)) {
+        ggml_backend_cpu_set_abort_callback(state->backend, abort_callback, abort_callback_data);
+    }
+}
+
 bool clip_model_quantize(const char * fname_inp, const char * fname_out, const int itype) {
     ggml_type type = GGML_TYPE_Q4_1;
 
@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 struct clip_ctx;
+struct clip_state;
 
 struct clip_image_u8_batch {
     struct clip_image_u8 * data;
@@ -24,13 +25,28 @@ struct clip_image_f32_batch {
     size_t size;
 };
 
+struct clip_model_params {
+    int  verbosity;
+    bool use_flash_attn; // fused attention in the vision encoder (F16 K/V)
+};
+
+CLIP_API struct clip_model_params clip_model_default_params(void);
+
 CLIP_API struct clip_ctx * clip_model_load    (const char * fname, int verbosity);
 CLIP_API struct clip_ctx * clip_model_load_cpu(const char * fname, int verbosity);
+CLIP_API struct clip_ctx * clip_model_load_with_params(const char * fname, struct clip_model_params params);
 
 CLIP_API void clip_free(struct clip_ctx * ctx);
 
+/** per-worker compute state (graph, allocator, backend) over the weights of ctx. Encodes with different states may run concurrently on one ctx; the calls without a state use the ctx's own */
+CLIP_API struct clip_state * clip_state_init(const struct clip_ctx * ctx);
+CLIP_API void clip_state_free(struct clip_state * state);
+
 CLIP_API size_t clip_embd_nbytes(const struct clip_ctx * ctx);
 
+/** identifies the loaded mmproj weights: embeddings made with one fingerprint only fit models paired with the same mmproj */
+CLIP_API uint64_t clip_model_fingerprint(const struct clip_ctx * ctx);
+
 CLIP_API int32_t clip_image_size (const struct clip_ctx * ctx);
 CLIP_API int32_t clip_patch_size (const struct clip_ctx * ctx);
 CLIP_API int32_t clip_hidden_size(const struct clip_ctx * ctx);
@@ -56,13 +72,41 @@ CLIP_API bool clip_image_load_from_file(const char * fname, struct clip_image_u8
 /** interpret bytes as an image file with length bytes_length, and use the result to populate img */
 CLIP_API bool clip_image_load_from_bytes(const unsigned char * bytes, size_t bytes_length, struct clip_image_u8 * img);
 
+/** copy nx * ny packed RGB pixels into img, for images decoded by the caller */
+CLIP_API void clip_image_load_from_pixels(const unsigned char * rgb, int nx, int ny, struct clip_image_u8 * img);
+
 /** preprocess img and store the result in res_imgs, pad_to_square may be overridden to false depending on model configuration */
 CLIP_API bool clip_image_preprocess(struct clip_ctx * ctx, const struct clip_image_u8 * img, struct clip_image_f32_batch * res_imgs );
 
 CLIP_API struct ggml_tensor * clip_get_newline_tensor(const struct clip_ctx * ctx);
 
 CLIP_API bool clip_image_encode      (struct clip_ctx * ctx, int n_threads, struct clip_image_f32 * img, float * vec);
+/** encodes imgs->size preprocessed images into vec, clip_embd_nbytes each and in order. MLP projectors run them as one graph, the others one image at a time */
 CLIP_API bool clip_image_batch_encode(struct clip_ctx * ctx, int n_threads, const struct clip_image_f32_batch * imgs, float * vec);
+CLIP_API bool clip_image_batch_encode_with_state(const struct clip_ctx * ctx, struct clip_state * state, int n_threads, const struct clip_image_f32_batch * imgs, float * vec);
+
+/** abort_callback is polled between graph nodes while encoding on the CPU backend, returning true aborts the encode, which then returns false */
+CLIP_API void clip_set_abort_callback(struct clip_ctx * ctx, bool (*abort_callback)(void * data), void * abort_callback_data);
+CLIP_API void clip_state_set_abort_callback(struct clip_state * state, bool (*abort_callback)(void * data), void * abort_callback_data);
+
+enum clip_profile_mode {
+    CLIP_PROFILE_NONE,
+    CLIP_PROFILE_BLOCKS, // patch embedding, attention and FFN of every layer, projector
+    CLIP_PROFILE_NODES,  // every ggml node, summed per block and op
+};
+
+struct clip_profile_entry {
+    char    name[64]; // "layer.07.attn", or "layer.07.attn/MUL_MAT" with CLIP_PROFILE_NODES
+    int64_t n_calls;  // encoder graphs that ran it
+    int64_t total_us;
+    int64_t max_us;   // slowest graph
+};
+
+/** times the encoder graph block by block (or node by node) and sums the wall times over every encode on ctx and its states. The graph is then computed in pieces, which costs some speed with BLOCKS and a lot with NODES. Set before encoding */
+CLIP_API void clip_set_profile(struct clip_ctx * ctx, enum clip_profile_mode mode);
+/** copies up to n_max entries in graph order and returns the total number of entries */
+CLIP_API int  clip_profile_get(const struct clip_ctx * ctx, struct clip_profile_entry * entries, int n_max);
+CLIP_API void clip_profile_reset(struct clip_ctx * ctx);
 
 CLIP_API bool clip_model_quantize(const char * fname_inp, const char * fname_out, int itype);
 
@@ -0,0 +1,538 @@
+// End-to-end benchmark of the CLIP vision encoder and the LLaVA-1.6 tile merge.
+//
+// llava.cpp is compiled into this binary so its static clip_llava_handle_patches can be called
+// directly, clip.cpp is built alongside it with the same flags as the llava library. Without
+// --mmproj a random-weight mmproj is written for every projector type (MLP, MLP_NORM, LDP, LDPv2)
+// with CLIP ViT-L/14-336 shapes, so the tool runs without downloading a model. Weights are F16
+// and norms/biases F32, like the converted models.
+//
+// Every configuration encodes 1 to 5 preprocessed 336x336 tiles with clip_image_batch_encode,
+// the tile counts of a LLaVA-1.6 image (base + 1x1, 1x2, 1x3 or 2x2 grid). With more than one
+// tile the grid tiles are then merged with clip_llava_handle_patches, for the projectors that
+// keep the full 24x24 patch grid (MLP, MLP_NORM; the LDP projectors pool it and are only used
+// with flat merging). img/s counts one image of the given tiles per encode + merge.
+//
+// Scaling efficiency is img/s relative to the lowest thread count, divided by the thread ratio.
+
+#include "llava.cpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+#include <map>
+
+#include <unistd.h>
+
+struct bench_options
+{
+    std::string mmproj;                // benchmark this file instead of synthetic models
+    std::vector<std::string> projectors = {"mlp", "mlp_norm", "ldp", "ldpv2"};
+    std::vector<int> tiles = {1, 2, 3, 4, 5};
+    std::vector<int> threads;          // default: powers of two up to the core count
+    int repeat = 3;                    // timed runs per configuration, median reported
+    int n_layer = 24;                  // synthetic models
+    int n_embd = 4096;                 // synthetic projector output, the LLM's n_embd
+};
+
+// CLIP ViT-L/14-336, the vision tower of LLaVA-1.5/1.6 and MobileVLM
+struct synth_hparams
+{
+    int hidden_size = 1024;
+    int n_head = 16;
+    int n_ff = 4096;
+    int n_layer = 24;
+    int image_size = 336;
+    int patch_size = 14;
+    int projection_dim = 768;
+    int n_embd = 4096;
+};
+
+enum synth_init
+{
+    SYNTH_RANDOM,
+    SYNTH_ONES,
+};
+
+struct synth_tensor
+{
+    std::string name;
+    ggml_type type;
+    std::vector<int64_t> ne;
+    synth_init init;
+};
+
+struct bench_result
+{
+    std::string projector;
+    int tiles;
+    int threads;
+    double encode_ms;
+    double merge_ms;
+};
+
+static std::vector<std::string> split_list(const std::string &s)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+static std::vector<int> split_int_list(const std::string &s)
+{
+    std::vector<int> values;
+    for (const std::string &item : split_list(s))
+    {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+// xorshift32, uniform in [-scale, scale]
+static float synth_random(uint32_t &state, float scale)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return scale * ((state >> 8) * (2.0f / 16777216.0f) - 1.0f);
+}
+
+// Tensor names and shapes as clip_model_load reads them
+static std::vector<synth_tensor> synth_tensors(const std::string &projector, const synth_hparams &hp)
+{
+    const int64_t H = hp.hidden_size;
+    const int64_t E = hp.n_embd;
+    const int64_t P = hp.patch_size;
+    const int64_t n_positions = (hp.image_size / hp.patch_size) * (hp.image_size / hp.patch_size) + 1;
+
+    std::vector<synth_tensor> t;
+    auto weight = [&t](const std::string &name, std::vector<int64_t> ne)
+    {
+        t.push_back({name, GGML_TYPE_F16, ne, SYNTH_RANDOM});
+    };
+    auto bias = [&t](const std::string &name, int64_t n)
+    {
+        t.push_back({name, GGML_TYPE_F32, {n}, SYNTH_RANDOM});
+    };
+    auto norm = [&t](const std::string &prefix, int64_t n)
+    {
+        t.push_back({prefix + ".weight", GGML_TYPE_F32, {n}, SYNTH_ONES});
+        t.push_back({prefix + ".bias", GGML_TYPE_F32, {n}, SYNTH_RANDOM});
+    };
+    auto linear = [&](const std::string &prefix, int64_t n_in, int64_t n_out)
+    {
+        weight(prefix + ".weight", {n_in, n_out});
+        bias(prefix + ".bias", n_out);
+    };
+
+    bias("v.class_embd", H);
+    weight("v.patch_embd.weight", {P, P, 3, H});
+    weight("v.position_embd.weight", {H, n_positions});
+    norm("v.pre_ln", H);
+
+    for (int il = 0; il < hp.n_layer; il++)
+    {
+        const std::string blk = "v.blk." + std::to_string(il) + ".";
+        linear(blk + "attn_q", H, H);
+        linear(blk + "attn_k", H, H);
+        linear(blk + "attn_v", H, H);
+        linear(blk + "attn_out", H, H);
+        norm(blk + "ln1", H);
+        norm(blk + "ln2", H);
+        // ffn_down is the first FFN matmul in clip.cpp's naming
+        linear(blk + "ffn_down", H, hp.n_ff);
+        linear(blk + "ffn_up", hp.n_ff, H);
+    }
+
+    if (projector == "mlp")
+    {
+        linear("mm.0", H, E);
+        linear("mm.2", E, E);
+        bias("model.image_newline", E);
+    }
+    else if (projector == "mlp_norm")
+    {
+        // detected from mm.3.weight, the file says "mlp"
+        linear("mm.0", H, E);
+        norm("mm.1", E);
+        linear("mm.3", E, E);
+        norm("mm.4", E);
+        bias("model.image_newline", E);
+    }
+    else if (projector == "ldp")
+    {
+        linear("mm.model.mlp.1", H, E);
+        linear("mm.model.mlp.3", E, E);
+        for (const std::string b : {"mm.model.mb_block.1.block.", "mm.model.mb_block.2.block."})
+        {
+            // depthwise 3x3 conv, layer norm, squeeze-excite, pointwise conv, layer norm
+            weight(b + "0.0.weight", {3, 3, 1, E});
+            norm(b + "0.1", E);
+            linear(b + "1.fc1", E, E / 4);
+            linear(b + "1.fc2", E / 4, E);
+            weight(b + "2.0.weight", {E, E});
+            norm(b + "2.1", E);
+        }
+    }
+    else if (projector == "ldpv2")
+    {
+        linear("mm.model.mlp.0", H, E);
+        linear("mm.model.mlp.2", E, E);
+        weight("mm.model.peg.0.weight", {3, 3, 1, E});
+        bias("mm.model.peg.0.bias", E);
+    }
+    else
+    {
+        t.clear();
+    }
+    return t;
+}
+
+// Writes a random-weight mmproj for the projector to fname
+static bool write_synthetic_mmproj(const std::string &fname, const std::string &projector, const synth_hparams &hp)
+{
+    const std::vector<synth_tensor> tensors = synth_tensors(projector, hp);
+    if (tensors.empty())
+    {
+        std::cerr << "Unknown projector type " << projector << std::endl;
+        return false;
+    }
+
+    size_t mem_size = 0;
+    for (const synth_tensor &st : tensors)
+    {
+        size_t n = 1;
+        for (int64_t ne : st.ne)
+        {
+            n *= ne;
+        }
+        mem_size += GGML_PAD(n * ggml_type_size(st.type), GGML_MEM_ALIGN) + ggml_tensor_overhead();
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ mem_size,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context *ctx = ggml_init(params);
+    if (!ctx)
+    {
+        std::cerr << "Unable to allocate " << mem_size / (1024 * 1024) << " MB for the synthetic model" << std::endl;
+        return false;
+    }
+
+    struct gguf_context *gguf = gguf_init_empty();
+    gguf_set_val_u32(gguf, "general.file_type", 1);
+    gguf_set_val_str(gguf, "general.name", "synthetic");
+    gguf_set_val_str(gguf, "general.description", "random weights, written by llava-bench-clip");
+    gguf_set_val_bool(gguf, "clip.has_text_encoder", false);
+    gguf_set_val_bool(gguf, "clip.has_vision_encoder", true);
+    gguf_set_val_bool(gguf, "clip.has_llava_projector", true);
+    gguf_set_val_bool(gguf, "clip.use_gelu", false);
+    gguf_set_val_str(gguf, "clip.projector_type", projector == "mlp_norm" ? "mlp" : projector.c_str());
+    gguf_set_val_u32(gguf, "clip.vision.embedding_length", hp.hidden_size);
+    gguf_set_val_u32(gguf, "clip.vision.attention.head_count", hp.n_head);
+    gguf_set_val_u32(gguf, "clip.vision.feed_forward_length", hp.n_ff);
+    gguf_set_val_u32(gguf, "clip.vision.block_count", hp.n_layer);
+    gguf_set_val_u32(gguf, "clip.vision.projection_dim", hp.projection_dim);
+    gguf_set_val_f32(gguf, "clip.vision.attention.layer_norm_epsilon", 1e-5f);
+    gguf_set_val_u32(gguf, "clip.vision.image_size", hp.image_size);
+    gguf_set_val_u32(gguf, "clip.vision.patch_size", hp.patch_size);
+
+    const float mean[3] = {0.48145466f, 0.4578275f, 0.40821073f};
+    const float std[3] = {0.26862954f, 0.26130258f, 0.27577711f};
+    gguf_set_arr_data(gguf, "clip.vision.image_mean", GGUF_TYPE_FLOAT32, mean, 3);
+    gguf_set_arr_data(gguf, "clip.vision.image_std", GGUF_TYPE_FLOAT32, std, 3);
+
+    if (projector == "mlp" || projector == "mlp_norm")
+    {
+        // LLaVA-1.6
+        const int32_t pinpoints[] = {336, 672, 672, 336, 672, 672, 1008, 336, 336, 1008};
+        gguf_set_arr_data(gguf, "clip.vision.image_grid_pinpoints", GGUF_TYPE_INT32, pinpoints, 10);
+        gguf_set_val_str(gguf, "clip.vision.mm_patch_merge_type", "spatial_unpad");
+    }
+
+    uint32_t rng = 0x9e3779b9u;
+    std::vector<float> values;
+    for (const synth_tensor &st : tensors)
+    {
+        std::vector<int64_t> ne = st.ne;
+        ne.resize(4, 1);
+        struct ggml_tensor *cur = ggml_new_tensor(ctx, st.type, (int)st.ne.size(), ne.data());
+        ggml_set_name(cur, st.name.c_str());
+
+        values.resize(ggml_nelements(cur));
+        for (float &v : values)
+        {
+            v = st.init == SYNTH_ONES ? 1.0f : synth_random(rng, 0.05f);
+        }
+        if (st.type == GGML_TYPE_F16)
+        {
+            ggml_fp32_to_fp16_row(values.data(), (ggml_fp16_t *)cur->data, values.size());
+        }
+        else
+        {
+            memcpy(cur->data, values.data(), values.size() * sizeof(float));
+        }
+        gguf_add_tensor(gguf, cur);
+    }
+
+    gguf_write_to_file(gguf, fname.c_str(), false);
+    gguf_free(gguf);
+    ggml_free(ctx);
+    return true;
+}
+
+static double median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+// Encodes n_tiles random tiles and merges them, for each thread count
+static void bench_model(clip_ctx *ctx_clip, const std::string &projector, const bench_options &options, std::vector<bench_result> &results)
+{
+    using clock = std::chrono::steady_clock;
+
+    const int image_size = clip_image_size(ctx_clip);
+    const int patches_per_side = image_size / clip_patch_size(ctx_clip);
+    const bool can_merge = clip_n_patches(ctx_clip) == patches_per_side * patches_per_side;
+    const size_t n_tile_floats = clip_embd_nbytes(ctx_clip) / sizeof(float);
+
+    // LLaVA-1.6 grids behind each tile count, the first tile is the base image
+    static const std::map<int, clip_image_grid_shape> grids = {{2, {1, 1}}, {3, {1, 2}}, {4, {1, 3}}, {5, {2, 2}}};
+
+    uint32_t rng = 42;
+    for (int n_tiles : options.tiles)
+    {
+        std::vector<clip_image_f32> tiles(n_tiles);
+        for (clip_image_f32 &tile : tiles)
+        {
+            tile.nx = image_size;
+            tile.ny = image_size;
+            tile.buf.resize(3 * (size_t)image_size * image_size);
+            for (float &v : tile.buf)
+            {
+                v = synth_random(rng, 2.0f);
+            }
+        }
+        clip_image_f32_batch batch;
+        batch.data = tiles.data();
+        batch.size = tiles.size();
+
+        std::vector<float> embd(n_tiles * n_tile_floats);
+        std::vector<float> merged(n_tiles * n_tile_floats);
+        std::vector<float *> tile_embd(n_tiles);
+        for (int t = 0; t < n_tiles; t++)
+        {
+            tile_embd[t] = embd.data() + t * n_tile_floats;
+        }
+        const bool merge = can_merge && grids.count(n_tiles) > 0;
+
+        for (int n_threads : options.threads)
+        {
+            std::vector<double> encode_ms, merge_ms;
+            // the first run sizes the compute buffer for the batch
+            for (int run = 0; run <= options.repeat; run++)
+            {
+                const auto t0 = clock::now();
+                if (!clip_image_batch_encode(ctx_clip, n_threads, &batch, embd.data()))
+                {
+                    std::cerr << projector << ": failed to encode " << n_tiles << " tiles" << std::endl;
+                    return;
+                }
+                const auto t1 = clock::now();
+                if (merge)
+                {
+                    int n_img_pos = 0;
+                    clip_llava_handle_patches(ctx_clip, tile_embd, grids.at(n_tiles), merged.data(), &n_img_pos);
+                }
+                const auto t2 = clock::now();
+                if (run > 0)
+                {
+                    encode_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+                    merge_ms.push_back(std::chrono::duration<double, std::milli>(t2 - t1).count());
+                }
+            }
+
+            bench_result r = {projector, n_tiles, n_threads, median(encode_ms), merge ? median(merge_ms) : -1.0};
+            results.push_back(r);
+
+            const double total_ms = r.encode_ms + std::max(r.merge_ms, 0.0);
+            char line[160], merge_col[16];
+            if (merge)
+            {
+                snprintf(merge_col, sizeof(merge_col), "%10.2f", r.merge_ms);
+            }
+            else
+            {
+                snprintf(merge_col, sizeof(merge_col), "%10s", "-");
+            }
+            snprintf(line, sizeof(line), "%-10s %5d %7d %10.2f %s %8.2f %8.2f", projector.c_str(), n_tiles, n_threads,
+                     r.encode_ms, merge_col, 1000.0 / total_ms, n_tiles * 1000.0 / total_ms);
+            std::cout << line << std::endl;
+        }
+    }
+}
+
+static void print_scaling(const std::vector<bench_result> &results, const std::vector<int> &threads)
+{
+    std::cout << std::endl
+              << "scaling efficiency (img/s relative to " << threads.front() << " thread" << (threads.front() > 1 ? "s" : "") << ", per thread)" << std::endl;
+    std::string header = "projector  tiles";
+    for (int n_threads : threads)
+    {
+        char col[16];
+        snprintf(col, sizeof(col), " %6dt", n_threads);
+        header += col;
+    }
+    std::cout << header << std::endl;
+
+    for (size_t i = 0; i < results.size(); i += threads.size())
+    {
+        const bench_result &base = results[i];
+        const double base_ms = base.encode_ms + std::max(base.merge_ms, 0.0);
+        char line[32];
+        snprintf(line, sizeof(line), "%-10s %5d", base.projector.c_str(), base.tiles);
+        std::string row = line;
+        for (size_t j = 0; j < threads.size() && i + j < results.size(); j++)
+        {
+            const bench_result &r = results[i + j];
+            const double speedup = base_ms / (r.encode_ms + std::max(r.merge_ms, 0.0));
+            char col[16];
+            snprintf(col, sizeof(col), " %6.0f%%", 100.0 * speedup * threads.front() / r.threads);
+            row += col;
+        }
+        std::cout << row << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--mmproj" && i + 1 < argc)
+        {
+            options.mmproj = argv[++i];
+        }
+        else if (arg == "--projector" && i + 1 < argc)
+        {
+            options.projectors = split_list(argv[++i]);
+        }
+        else if (arg == "--tiles" && i + 1 < argc)
+        {
+            options.tiles = split_int_list(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            options.threads = split_int_list(argv[++i]);
+        }
+        else if (arg == "--repeat" && i + 1 < argc)
+        {
+            options.repeat = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--layers" && i + 1 < argc)
+        {
+            options.n_layer = std::max(2, std::stoi(argv[++i]));
+        }
+        else if (arg == "--n-embd" && i + 1 < argc)
+        {
+            options.n_embd = std::stoi(argv[++i]);
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--mmproj <file>] [--projector mlp,mlp_norm,ldp,ldpv2] [--tiles 1,2,3,4,5]"
+                      << " [--threads 1,2,4] [--repeat <n>] [--layers <n>] [--n-embd <n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.threads.empty())
+    {
+        const int n_cores = std::max(1u, std::thread::hardware_concurrency());
+        for (int n = 1; n < n_cores; n *= 2)
+        {
+            options.threads.push_back(n);
+        }
+        options.threads.push_back(n_cores);
+    }
+    for (int n_tiles : options.tiles)
+    {
+        if (n_tiles < 1 || n_tiles > 5)
+        {
+            std::cerr << "--tiles takes tile counts from 1 to 5" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string>> models; // projector label, file
+    const char *tmp_dir = getenv("TMPDIR");
+    if (!options.mmproj.empty())
+    {
+        models.push_back({"mmproj", options.mmproj});
+    }
+    else
+    {
+        for (const std::string &projector : options.projectors)
+        {
+            models.push_back({projector, std::string(tmp_dir ? tmp_dir : "/tmp") + "/llava-bench-clip-" + projector + "-" + std::to_string(getpid()) + ".gguf"});
+        }
+    }
+
+    synth_hparams hp;
+    hp.n_layer = options.n_layer;
+    hp.n_embd = options.n_embd;
+
+    std::vector<bench_result> results;
+    bool header = false;
+    for (const auto &model : models)
+    {
+        const bool synthetic = options.mmproj.empty();
+        if (synthetic && !write_synthetic_mmproj(model.second, model.first, hp))
+        {
+            return 1;
+        }
+
+        clip_ctx *ctx_clip = nullptr;
+        try
+        {
+            ctx_clip = clip_model_load(model.second.c_str(), 0);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Unable to load " << model.second << ": " << e.what() << std::endl;
+        }
+        if (synthetic)
+        {
+            std::remove(model.second.c_str());
+        }
+        if (!ctx_clip)
+        {
+            return 1;
+        }
+
+        if (!header)
+        {
+            std::cout << "projector  tiles threads  encode ms   merge ms    img/s  tiles/s" << std::endl;
+            header = true;
+        }
+        bench_model(ctx_clip, model.first, options, results);
+        clip_free(ctx_clip);
+    }
+
+    print_scaling(results, options.threads);
+    return 0;
+}
@@ -0,0 +1,212 @@
+// Microbenchmarks for the CLIP image preprocessing kernels.
+//
+// clip.cpp is compiled into this binary so its static kernels can be called directly, with the
+// same flags as the llava library (LLAVA_ISA_DISPATCH included). Every kernel runs on random
+// RGB images from VGA to 48 MP, square and panoramic, with the targets clip_image_preprocess
+// uses: 336x336 for the plain resizes, the best LLaVA-1.6 grid resolution for
+// resize_and_pad_image, 336 px tiles for divide_to_patches_u8. The linear kernels
+// (normalize, the HWC->CHW transpose and the patch gather of clip_image_batch_encode) run on
+// the full image.
+//
+// ns/px is per pixel written. GB/s counts the bytes of the input and the output buffer once
+// each, over the kernel's time.
+
+#include "clip.cpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <algorithm>
+
+struct bench_size
+{
+    const char *name;
+    int nx;
+    int ny;
+};
+
+static const bench_size bench_sizes[] = {
+    {"vga", 640, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"square-1k", 1024, 1024},
+    {"4k", 3840, 2160},
+    {"12mp", 4032, 3024},
+    {"square-4k", 4096, 4096},
+    {"pano-6k", 6000, 1500},
+    {"pano-12k", 12000, 2000},
+    {"48mp", 8064, 6048},
+};
+
+// LLaVA-1.6 image_grid_pinpoints
+static const std::vector<std::pair<int, int>> bench_resolutions = {{336, 672}, {672, 336}, {672, 672}, {1008, 336}, {336, 1008}};
+
+static const int bench_image_size = 336;
+static const int bench_patch_size = 14;
+
+struct bench_options
+{
+    std::string filter;   // kernel or size name substring
+    double min_ms = 300;  // per kernel and size
+    double max_mp = 50;   // skip larger inputs
+};
+
+// Median time of one call, over enough calls to fill min_ms. reset runs after every call,
+// untimed.
+static double time_kernel(const std::function<void()> &kernel, double min_ms, const std::function<void()> &reset = nullptr)
+{
+    using clock = std::chrono::steady_clock;
+    kernel(); // warm up caches, page in the output
+    if (reset)
+    {
+        reset();
+    }
+    std::vector<double> runs;
+    const auto t_start = clock::now();
+    while (runs.size() < 3 || std::chrono::duration<double, std::milli>(clock::now() - t_start).count() < min_ms)
+    {
+        const auto t0 = clock::now();
+        kernel();
+        runs.push_back(std::chrono::duration<double, std::milli>(clock::now() - t0).count());
+        if (reset)
+        {
+            reset();
+        }
+    }
+    std::sort(runs.begin(), runs.end());
+    return runs[runs.size() / 2];
+}
+
+static void report(const char *kernel, const bench_size &size, int out_nx, int out_ny, double ms, size_t bytes)
+{
+    char in[32], out[32], line[160];
+    snprintf(in, sizeof(in), "%dx%d", size.nx, size.ny);
+    snprintf(out, sizeof(out), "%dx%d", out_nx, out_ny);
+    const double pixels = (double)out_nx * out_ny;
+    snprintf(line, sizeof(line), "%-26s %-10s %-12s %-12s %10.3f %8.2f %8.2f", kernel, size.name, in, out, ms, ms * 1e6 / pixels, bytes / (ms * 1e6));
+    std::cout << line << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+        {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--min-ms" && i + 1 < argc)
+        {
+            options.min_ms = std::stod(argv[++i]);
+        }
+        else if (arg == "--max-mp" && i + 1 < argc)
+        {
+            options.max_mp = std::stod(argv[++i]);
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--filter <kernel or size>] [--min-ms <ms>] [--max-mp <megapixels>]" << std::endl;
+            return 1;
+        }
+    }
+
+    // CLIP's default normalization
+    const float mean[3] = {0.48145466f, 0.4578275f, 0.40821073f};
+    const float std[3] = {0.26862954f, 0.26130258f, 0.27577711f};
+
+    std::mt19937 rng(42);
+    std::cout << "kernel                     size       input        output          ms/call    ns/px     GB/s" << std::endl;
+    for (const bench_size &size : bench_sizes)
+    {
+        if ((double)size.nx * size.ny > options.max_mp * 1e6)
+        {
+            continue;
+        }
+        auto selected = [&](const char *kernel)
+        {
+            return options.filter.empty() || std::string(kernel).find(options.filter) != std::string::npos ||
+                   std::string(size.name).find(options.filter) != std::string::npos;
+        };
+
+        clip_image_u8 img;
+        img.nx = size.nx;
+        img.ny = size.ny;
+        img.buf.resize(3 * (size_t)size.nx * size.ny);
+        std::generate(img.buf.begin(), img.buf.end(), [&rng]()
+                      { return (uint8_t)rng(); });
+        const size_t img_bytes = img.buf.size();
+
+        if (selected("bilinear_resize"))
+        {
+            clip_image_u8 dst;
+            double ms = time_kernel([&]()
+                                    { bilinear_resize(img, dst, bench_image_size, bench_image_size); }, options.min_ms);
+            report("bilinear_resize", size, dst.nx, dst.ny, ms, img_bytes + dst.buf.size());
+        }
+        if (selected("bicubic_resize"))
+        {
+            clip_image_u8 dst;
+            double ms = time_kernel([&]()
+                                    { bicubic_resize(img, dst, bench_image_size, bench_image_size); }, options.min_ms);
+            report("bicubic_resize", size, dst.nx, dst.ny, ms, img_bytes + dst.buf.size());
+        }
+        if (selected("resize_and_pad_image"))
+        {
+            const std::pair<int, int> resolution = select_best_resolution({size.nx, size.ny}, bench_resolutions);
+            clip_image_u8 dst;
+            double ms = time_kernel([&]()
+                                    { resize_and_pad_image(img, dst, resolution); }, options.min_ms);
+            report("resize_and_pad_image", size, dst.nx, dst.ny, ms, img_bytes + dst.buf.size());
+        }
+        if (selected("divide_to_patches_u8"))
+        {
+            // the patches of each call are freed before the next one, outside the timed region
+            std::vector<clip_image_u8 *> patches;
+            auto free_patches = [&patches]()
+            {
+                for (clip_image_u8 *patch : patches)
+                {
+                    clip_image_u8_free(patch);
+                }
+                patches.clear();
+            };
+            double ms = time_kernel([&]()
+                                    { patches = divide_to_patches_u8(img, bench_image_size); }, options.min_ms, free_patches);
+            free_patches();
+            report("divide_to_patches_u8", size, size.nx, size.ny, ms, 2 * img_bytes);
+        }
+
+        clip_image_f32 normalized;
+        if (selected("normalize_image_u8_to_f32") || selected("clip_image_to_chw") || selected("clip_image_to_patches"))
+        {
+            double ms = time_kernel([&]()
+                                    { normalize_image_u8_to_f32(&img, &normalized, mean, std); }, options.min_ms);
+            if (selected("normalize_image_u8_to_f32"))
+            {
+                report("normalize_image_u8_to_f32", size, size.nx, size.ny, ms, img_bytes + normalized.buf.size() * sizeof(float));
+            }
+        }
+        if (selected("clip_image_to_chw"))
+        {
+            std::vector<float> dst(normalized.buf.size());
+            double ms = time_kernel([&]()
+                                    { clip_image_to_chw(normalized, dst.data()); }, options.min_ms);
+            report("clip_image_to_chw", size, size.nx, size.ny, ms, 2 * dst.size() * sizeof(float));
+        }
+        if (selected("clip_image_to_patches"))
+        {
+            const int nx = size.nx / bench_patch_size * bench_patch_size;
+            const int ny = size.ny / bench_patch_size * bench_patch_size;
+            std::vector<float> dst(3 * (size_t)nx * ny);
+            double ms = time_kernel([&]()
+                                    { clip_image_to_patches(normalized, bench_patch_size, dst.data()); }, options.min_ms);
+            report("clip_image_to_patches", size, nx, ny, ms, 2 * dst.size() * sizeof(float));
+        }
+    }
+    return 0;
+}
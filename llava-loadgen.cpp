@@ -0,0 +1,463 @@
+// Load generator for llava-server.
+//
+// Replays a JSONL corpus of chat completion requests (the llava-batch input format: a request
+// per line, or {"custom_id", "body"}) against a running server, either open-loop at a fixed
+// Poisson arrival rate (--rate) or closed-loop with a fixed number of clients (--concurrency).
+// Requests are streamed so every response yields its time to first token, the gaps between
+// chunks and the end-to-end latency. Open-loop latencies count from the scheduled arrival, not
+// from when a client got around to sending, so an overloaded server can not hide its queue.
+// Streamed chunks stand in for tokens: the server sends one per decoded token, merged only
+// while a character is incomplete. Prints percentile tables and optionally writes a JSON
+// summary (--json).
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+using steady_clock = std::chrono::steady_clock;
+
+struct loadgen_options
+{
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    std::string input;
+    std::string json_path;
+    double rate = 0;     // requests/s, > 0: open loop
+    int concurrency = 1; // closed loop clients
+    size_t n_requests = 0; // 0: one pass over the corpus
+    double duration_s = 0; // 0: no limit
+    bool stream = true;
+    uint32_t seed = 42;
+};
+
+// Outcome of one request
+struct request_sample
+{
+    int status = 0; // HTTP status, 0: connection failed or the response was cut off
+    double ttft_ms = -1;
+    double e2e_ms = 0;
+    std::vector<double> itl_ms; // between consecutive content chunks
+    int n_chunks = 0;
+};
+
+static double ms_between(steady_clock::time_point from, steady_clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static std::vector<std::string> read_corpus(const std::string &path, bool stream)
+{
+    std::vector<std::string> bodies;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        json entry = json::parse(line, nullptr, false);
+        if (!entry.is_object())
+        {
+            continue;
+        }
+        json request = entry.contains("body") && entry["body"].is_object() ? entry["body"] : entry;
+        request["stream"] = stream;
+        bodies.push_back(request.dump());
+    }
+    return bodies;
+}
+
+static int connect_to(const loadgen_options &options)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(), &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *a = addresses; a && fd < 0; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+static bool send_all(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Sends one request and follows its response. The server closes the connection after each
+// response, so the body runs to EOF; streamed bodies are split into server-sent events and
+// every event with content counts as a chunk.
+static request_sample run_request(const loadgen_options &options, const std::string &body, steady_clock::time_point start)
+{
+    request_sample sample;
+    int fd = connect_to(options);
+    if (fd < 0)
+    {
+        sample.e2e_ms = ms_between(start, steady_clock::now());
+        return sample;
+    }
+
+    std::string request = "POST /v1/chat/completions HTTP/1.1\r\nHost: " + options.host +
+                          "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+                          "\r\nConnection: close\r\n\r\n" + body;
+    if (!send_all(fd, request))
+    {
+        close(fd);
+        sample.e2e_ms = ms_between(start, steady_clock::now());
+        return sample;
+    }
+
+    std::string buffer;
+    size_t header_end = std::string::npos;
+    size_t event_start = 0;
+    bool done = false;
+    steady_clock::time_point last_chunk;
+    char chunk[4096];
+    ssize_t n;
+    while (!done && (n = recv(fd, chunk, sizeof(chunk), 0)) > 0)
+    {
+        const steady_clock::time_point now = steady_clock::now();
+        buffer.append(chunk, n);
+        if (header_end == std::string::npos)
+        {
+            header_end = buffer.find("\r\n\r\n");
+            if (header_end == std::string::npos)
+            {
+                continue;
+            }
+            std::istringstream status_line(buffer.substr(0, buffer.find("\r\n")));
+            std::string version;
+            status_line >> version >> sample.status;
+            event_start = header_end + 4;
+        }
+        if (sample.status != 200 || !options.stream)
+        {
+            continue;
+        }
+
+        size_t event_end;
+        while ((event_end = buffer.find("\n\n", event_start)) != std::string::npos)
+        {
+            std::string event = buffer.substr(event_start, event_end - event_start);
+            event_start = event_end + 2;
+            if (event.compare(0, 6, "data: ") != 0)
+            {
+                continue;
+            }
+            if (event == "data: [DONE]")
+            {
+                done = true;
+                break;
+            }
+            json data = json::parse(event.substr(6), nullptr, false);
+            if (!data.is_object() || !data.contains("choices") || data["choices"].empty() ||
+                !data["choices"][0]["delta"].contains("content"))
+            {
+                continue;
+            }
+            if (sample.n_chunks == 0)
+            {
+                sample.ttft_ms = ms_between(start, now);
+            }
+            else
+            {
+                sample.itl_ms.push_back(ms_between(last_chunk, now));
+            }
+            last_chunk = now;
+            sample.n_chunks++;
+        }
+    }
+    close(fd);
+    sample.e2e_ms = ms_between(start, steady_clock::now());
+
+    if (sample.status == 200 && options.stream && !done)
+    {
+        sample.status = 0; // the stream ended without [DONE]
+    }
+    if (sample.status == 200 && !options.stream)
+    {
+        // the whole answer arrives at once
+        json response = json::parse(buffer.substr(header_end + 4), nullptr, false);
+        if (response.is_object() && response.contains("usage"))
+        {
+            sample.n_chunks = response["usage"].value("completion_tokens", 0);
+        }
+        sample.ttft_ms = sample.e2e_ms;
+    }
+    return sample;
+}
+
+struct latency_summary
+{
+    size_t count = 0;
+    double mean = 0, p50 = 0, p90 = 0, p95 = 0, p99 = 0, max = 0;
+};
+
+static latency_summary summarize(std::vector<double> values)
+{
+    latency_summary s;
+    s.count = values.size();
+    if (values.empty())
+    {
+        return s;
+    }
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](double p)
+    {
+        size_t rank = (size_t)std::ceil(p / 100 * values.size());
+        return values[std::min(values.size(), std::max<size_t>(1, rank)) - 1];
+    };
+    s.mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    s.p50 = percentile(50);
+    s.p90 = percentile(90);
+    s.p95 = percentile(95);
+    s.p99 = percentile(99);
+    s.max = values.back();
+    return s;
+}
+
+static json summary_json(const latency_summary &s)
+{
+    return {{"count", s.count}, {"mean", s.mean}, {"p50", s.p50}, {"p90", s.p90}, {"p95", s.p95}, {"p99", s.p99}, {"max", s.max}};
+}
+
+static void print_row(const char *name, const latency_summary &s)
+{
+    char line[160];
+    snprintf(line, sizeof(line), "%-10s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f", name, s.count, s.mean, s.p50, s.p90, s.p95, s.p99, s.max);
+    std::cout << line << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    loadgen_options options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--host" && i + 1 < argc)
+        {
+            options.host = argv[++i];
+        }
+        else if (arg == "--port" && i + 1 < argc)
+        {
+            options.port = std::stoi(argv[++i]);
+        }
+        else if (arg == "--input" && i + 1 < argc)
+        {
+            options.input = argv[++i];
+        }
+        else if (arg == "--json" && i + 1 < argc)
+        {
+            options.json_path = argv[++i];
+        }
+        else if (arg == "--rate" && i + 1 < argc)
+        {
+            options.rate = std::stod(argv[++i]);
+        }
+        else if (arg == "--concurrency" && i + 1 < argc)
+        {
+            options.concurrency = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--requests" && i + 1 < argc)
+        {
+            options.n_requests = std::stoul(argv[++i]);
+        }
+        else if (arg == "--duration" && i + 1 < argc)
+        {
+            options.duration_s = std::stod(argv[++i]);
+        }
+        else if (arg == "--no-stream")
+        {
+            options.stream = false;
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            options.seed = std::stoul(argv[++i]);
+        }
+    }
+
+    if (options.input.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " --input <requests.jsonl> [--host <host>] [--port <port>]"
+                  << " [--rate <requests/s> | --concurrency <n>] [--requests <n>] [--duration <s>]"
+                  << " [--no-stream] [--seed <n>] [--json <summary.json>]" << std::endl;
+        return 1;
+    }
+
+    const std::vector<std::string> corpus = read_corpus(options.input, options.stream);
+    if (corpus.empty())
+    {
+        std::cerr << "No requests in " << options.input << std::endl;
+        return 1;
+    }
+    // a duration alone runs until it is over, cycling through the corpus
+    const size_t n_requests = options.n_requests > 0 ? options.n_requests : options.duration_s > 0 ? SIZE_MAX : corpus.size();
+    const bool open_loop = options.rate > 0;
+
+    std::mutex mutex;
+    std::vector<request_sample> samples;
+    auto record = [&](request_sample sample)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.push_back(std::move(sample));
+    };
+
+    const steady_clock::time_point t_start = steady_clock::now();
+    const steady_clock::time_point t_end = options.duration_s > 0
+                                               ? t_start + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(options.duration_s))
+                                               : steady_clock::time_point::max();
+    std::vector<std::thread> clients;
+    if (open_loop)
+    {
+        // Poisson arrivals: exponential gaps, every request on its own client
+        std::mt19937 rng(options.seed);
+        std::exponential_distribution<double> gap_s(options.rate);
+        steady_clock::time_point arrival = t_start;
+        for (size_t i = 0; i < n_requests; i++)
+        {
+            if (i > 0)
+            {
+                arrival += std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(gap_s(rng)));
+            }
+            if (arrival >= t_end)
+            {
+                break;
+            }
+            std::this_thread::sleep_until(arrival);
+            clients.emplace_back([&, i, arrival]()
+                                 { record(run_request(options, corpus[i % corpus.size()], arrival)); });
+        }
+    }
+    else
+    {
+        // closed loop: every client sends its next request when the previous one finished
+        std::atomic<size_t> next{0};
+        for (int c = 0; c < options.concurrency; c++)
+        {
+            clients.emplace_back([&]()
+                                 {
+                size_t i;
+                while ((i = next++) < n_requests && steady_clock::now() < t_end)
+                {
+                    record(run_request(options, corpus[i % corpus.size()], steady_clock::now()));
+                } });
+        }
+    }
+    for (std::thread &client : clients)
+    {
+        client.join();
+    }
+    const double elapsed_s = ms_between(t_start, steady_clock::now()) / 1000;
+
+    std::vector<double> ttft, itl, e2e;
+    std::map<int, size_t> by_status;
+    size_t n_ok = 0;
+    long long n_chunks = 0;
+    for (const request_sample &sample : samples)
+    {
+        by_status[sample.status]++;
+        if (sample.status != 200)
+        {
+            continue;
+        }
+        n_ok++;
+        n_chunks += sample.n_chunks;
+        e2e.push_back(sample.e2e_ms);
+        if (sample.ttft_ms >= 0)
+        {
+            ttft.push_back(sample.ttft_ms);
+        }
+        itl.insert(itl.end(), sample.itl_ms.begin(), sample.itl_ms.end());
+    }
+    const latency_summary ttft_summary = summarize(ttft), itl_summary = summarize(itl), e2e_summary = summarize(e2e);
+
+    if (open_loop)
+    {
+        std::cout << "open loop, " << options.rate << " requests/s";
+    }
+    else
+    {
+        std::cout << "closed loop, " << options.concurrency << " clients";
+    }
+    std::cout << ", " << samples.size() << " requests in " << elapsed_s << " s" << std::endl;
+    std::cout << "status:";
+    for (const auto &status : by_status)
+    {
+        std::cout << " " << (status.first ? std::to_string(status.first) : "failed") << "=" << status.second;
+    }
+    std::cout << std::endl;
+    std::cout << "throughput: " << n_ok / elapsed_s << " requests/s, " << n_chunks / elapsed_s << " tokens/s" << std::endl
+              << std::endl;
+    std::cout << "latency ms    count      mean       p50       p90       p95       p99       max" << std::endl;
+    print_row("ttft", ttft_summary);
+    print_row("itl", itl_summary);
+    print_row("e2e", e2e_summary);
+
+    if (!options.json_path.empty())
+    {
+        json statuses = json::object();
+        for (const auto &status : by_status)
+        {
+            statuses[status.first ? std::to_string(status.first) : "failed"] = status.second;
+        }
+        json summary = {
+            {"mode", open_loop ? "open" : "closed"},
+            {"rate", options.rate},
+            {"concurrency", open_loop ? 0 : options.concurrency},
+            {"stream", options.stream},
+            {"duration_s", elapsed_s},
+            {"requests", {{"sent", samples.size()}, {"ok", n_ok}, {"by_status", statuses}}},
+            {"throughput", {{"requests_per_s", n_ok / elapsed_s}, {"tokens_per_s", n_chunks / elapsed_s}}},
+            {"ttft_ms", summary_json(ttft_summary)},
+            {"itl_ms", summary_json(itl_summary)},
+            {"e2e_ms", summary_json(e2e_summary)}};
+        std::ofstream out(options.json_path);
+        out << summary.dump(2) << std::endl;
+        if (!out)
+        {
+            std::cerr << "Failed to write " << options.json_path << std::endl;
+            return 1;
+        }
+    }
+    return n_ok == samples.size() ? 0 : 2;
+}
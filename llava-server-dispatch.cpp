@@ -0,0 +1,168 @@
+// llava-server launcher for builds with LLAVA_ISA_DISPATCH.
+//
+// Every ISA level in LLAVA_ISA_VARIANTS (CMakeLists.txt) is built as its own llava-server-<level>
+// binary next to this one. At startup we read cpuid/xgetbv, pick the highest level the CPU and the
+// OS support, export it as LLAVA_ISA_LEVEL (logged and reported in /metrics by the server) and exec
+// that binary with the original arguments. Setting LLAVA_ISA_LEVEL beforehand caps the level.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <limits.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+struct cpu_features
+{
+    bool avx         = false;
+    bool avx2        = false;
+    bool fma         = false;
+    bool f16c        = false;
+    bool avx512      = false; // F, CD, BW, DQ, VL
+    bool avx512_vnni = false; // VNNI, VBMI
+    bool avx512_bf16 = false;
+};
+
+struct isa_level
+{
+    const char *name;
+    bool (*supported)(const cpu_features &);
+};
+
+// highest first, "generic" is the plain build and always runs
+static const isa_level isa_levels[] = {
+    {"avx512_bf16", [](const cpu_features &f) { return f.avx512 && f.avx512_vnni && f.avx512_bf16; }},
+    {"avx512_vnni", [](const cpu_features &f) { return f.avx512 && f.avx512_vnni; }},
+    {"avx512",      [](const cpu_features &f) { return f.avx512; }},
+    {"avx2",        [](const cpu_features &f) { return f.avx && f.avx2 && f.fma && f.f16c; }},
+    {"generic",     [](const cpu_features &) { return true; }},
+};
+
+static cpu_features detect_cpu_features()
+{
+    cpu_features f;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return f;
+    }
+
+    const bool osxsave = ecx & (1u << 27);
+    f.fma  = ecx & (1u << 12);
+    f.avx  = ecx & (1u << 28);
+    f.f16c = ecx & (1u << 29);
+
+    // the OS has to save the YMM/ZMM state, otherwise the instructions fault
+    unsigned long long xcr0 = 0;
+    if (osxsave)
+    {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        xcr0 = ((unsigned long long)xcr0_hi << 32) | xcr0_lo;
+    }
+    const bool os_avx    = (xcr0 & 0x06) == 0x06;
+    const bool os_avx512 = os_avx && (xcr0 & 0xe0) == 0xe0;
+
+    f.avx  = f.avx && os_avx;
+    f.fma  = f.fma && os_avx;
+    f.f16c = f.f16c && os_avx;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        f.avx2 = os_avx && (ebx & (1u << 5));
+
+        const bool avx512f  = ebx & (1u << 16);
+        const bool avx512dq = ebx & (1u << 17);
+        const bool avx512cd = ebx & (1u << 28);
+        const bool avx512bw = ebx & (1u << 30);
+        const bool avx512vl = ebx & (1u << 31);
+        f.avx512 = os_avx512 && avx512f && avx512dq && avx512cd && avx512bw && avx512vl;
+
+        const bool avx512vbmi = ecx & (1u << 1);
+        const bool avx512vnni = ecx & (1u << 11);
+        f.avx512_vnni = f.avx512 && avx512vbmi && avx512vnni;
+    }
+
+    if (__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx))
+    {
+        f.avx512_bf16 = f.avx512 && (eax & (1u << 5));
+    }
+#endif
+    return f;
+}
+
+static std::string executable_dir()
+{
+    char path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0)
+    {
+        return ".";
+    }
+    path[len] = '\0';
+
+    std::string dir(path);
+    size_t slash = dir.rfind('/');
+    return slash == std::string::npos ? "." : dir.substr(0, slash);
+}
+
+int main(int argc, char *argv[])
+{
+    const cpu_features features = detect_cpu_features();
+    const std::string dir = executable_dir();
+
+    // an explicit LLAVA_ISA_LEVEL caps the search, e.g. to compare levels on one machine
+    const char *requested = std::getenv("LLAVA_ISA_LEVEL");
+    bool capped = requested == nullptr;
+
+    for (const isa_level &level : isa_levels)
+    {
+        if (!capped)
+        {
+            if (std::strcmp(level.name, requested) != 0)
+            {
+                continue;
+            }
+            capped = true;
+        }
+
+        if (!level.supported(features))
+        {
+            continue;
+        }
+
+        std::string binary = dir + "/llava-server-" + level.name;
+        if (access(binary.c_str(), X_OK) != 0)
+        {
+            continue;
+        }
+
+        std::cerr << "llava-server: selected ISA level " << level.name << " (" << binary << ")" << std::endl;
+        setenv("LLAVA_ISA_LEVEL", level.name, 1);
+
+        std::vector<char *> args(argv, argv + argc);
+        args.push_back(nullptr);
+        execv(binary.c_str(), args.data());
+
+        std::cerr << "llava-server: failed to exec " << binary << ": " << std::strerror(errno) << std::endl;
+    }
+
+    if (!capped)
+    {
+        std::cerr << "llava-server: unknown ISA level '" << requested << "' in LLAVA_ISA_LEVEL" << std::endl;
+    }
+    else
+    {
+        std::cerr << "llava-server: no usable llava-server-<isa> binary found in " << dir << std::endl;
+    }
+    return 1;
+}
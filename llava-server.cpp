@@ -7,14 +7,36 @@
 #include <queue>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <chrono>
+#include <atomic>
+#include <deque>
+#include <array>
+#include <functional>
+#include <future>
+#include <memory>
+#include <set>
+#include <random>
+#include <unordered_map>
+#include <cmath>
+#include <iterator>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #include <opencv2/opencv.hpp>
 #include <curl/curl.h>
@@ -33,14 +55,552 @@ using json = nlohmann::json;
 
 // Global variables
 struct clip_ctx *clip_ctx;
+int clip_batch_max = 8; // CLIP tiles per encoder graph (--vision-batch)
+bool allow_half_close = false; // a client's FIN alone does not cancel its request (--allow-half-close)
 llama_model *llama_model;
 llama_context *llama_ctx;
 
+// Speculative decoding mode, chosen per request
+enum speculative_mode
+{
+    SPEC_NONE,
+    SPEC_DRAFT, // draft model (--draft-model)
+    SPEC_NGRAM, // prompt lookup: continue an earlier occurrence of the last n-gram
+    SPEC_COUNT,
+};
+
+static const char *speculative_mode_names[SPEC_COUNT] = {"none", "draft", "ngram"};
+
+// Priority class, chosen per request. Lane queues serve lower classes first.
+enum priority_class
+{
+    PRIORITY_INTERACTIVE,
+    PRIORITY_BATCH,
+    PRIORITY_COUNT,
+};
+
+static const char *priority_class_names[PRIORITY_COUNT] = {"interactive", "batch"};
+
+static double steady_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Position of a job in a lane queue: class first, then earliest deadline. Requests without
+// an explicit deadline get the time weighted fair sharing between API keys would finish them.
+struct job_order
+{
+    priority_class priority = PRIORITY_INTERACTIVE;
+    double deadline_ms = 0; // steady clock milliseconds
+    double vstart = 0;      // fair share start tag, advances the virtual clock when dispatched
+};
+
+// Sampling settings, from the OpenAI request fields plus the usual llama.cpp extensions
+struct sampling_params
+{
+    float temperature = 1.0f; // <= 0: greedy
+    float top_p = 1.0f;
+    int top_k = 0;            // 0: disabled
+    float min_p = 0.0f;       // keep tokens with p >= min_p * p_max
+    float presence_penalty = 0.0f;
+    float frequency_penalty = 0.0f;
+    float repeat_penalty = 1.0f;
+    int penalty_last_n = 64;  // window of prompt + output tokens the penalties look at
+    uint32_t seed = 0xFFFFFFFF; // random
+};
+
+// Per-request generation settings
+struct generation_params
+{
+    sampling_params sampling;
+    int n_predict = 500;            // max_tokens
+    std::vector<std::string> stop;  // stop sequences, not included in the output
+    std::function<void(const std::string &)> on_text; // streaming: receives complete UTF-8 chunks
+    const std::atomic<bool> *cancel = nullptr;        // set once the client went away
+    speculative_mode speculative = SPEC_NONE;
+    int n_draft = 8;    // tokens proposed per step for SPEC_NGRAM, SPEC_DRAFT uses --draft-n
+    int ngram_size = 3; // longest n-gram matched for SPEC_NGRAM, shorter ones are tried next
+    job_order order;
+    double deadline_ms = 0;   // explicit client deadline (steady clock ms), 0: none
+    double est_vision_ms = 0; // admission estimates, checked against the deadline at dispatch
+    double est_text_ms = 0;
+    uint64_t request_id = 0; // tags trace spans, 0: untraced
+};
+
+// Output of one generation
+struct generation_result
+{
+    std::string text;
+    std::string finish_reason = "stop"; // "stop", "length", "error", "cancelled" or "deadline"
+    int n_prompt = 0;
+    int n_generated = 0;
+    double vision_ms = 0; // measured stage costs, feed the admission estimates
+    double prefill_ms = 0;
+    double decode_ms = 0;
+    std::vector<int> image_tokens; // embedding positions of each image, in request order
+    int images_encoded = 0;        // of them encoded by CLIP here, vision_ms is their cost
+};
+
+// One image of a request: an image file for CLIP, or an embedding computed elsewhere
+struct image_input
+{
+    std::string bytes;       // image file, any format OpenCV decodes
+    std::vector<float> embd; // precomputed: n_pos * n_embd floats
+    int n_pos = 0;
+
+    bool precomputed() const { return n_pos > 0; }
+};
+
+// A chat completion request as the lanes take it
+struct chat_request
+{
+    std::string system_message;
+    std::vector<std::string> user_texts = std::vector<std::string>(1); // texts[i] comes before images[i], the last text after the last image
+    std::vector<image_input> images;
+    generation_params params;
+};
+
+// Text of every token, built once at startup so the decode loop never calls
+// llama_token_to_piece: piece id is arena[offsets[id], offsets[id + 1])
+struct piece_table
+{
+    std::string arena;
+    std::vector<uint32_t> offsets;
+
+    const char *data(llama_token id) const { return arena.data() + offsets[id]; }
+    size_t size(llama_token id) const { return offsets[id + 1] - offsets[id]; }
+};
+piece_table pieces;
+
+// Splits a byte stream into chunks that end on UTF-8 code point boundaries, so a multi-byte
+// character split over two tokens is never streamed half
+struct utf8_assembler
+{
+    std::string pending;
+
+    // Appends bytes and returns the complete code points buffered so far
+    std::string push(const char *data, size_t len);
+};
+
+// Chunks of a streamed response, produced on the text lane and written to the socket by the
+// connection thread, so a slow client never stalls the lane
+struct stream_channel
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> chunks;
+    bool closed = false;
+
+    void push(std::string chunk)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunks.push_back(std::move(chunk));
+        }
+        cv.notify_one();
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        cv.notify_one();
+    }
+
+    // Waits up to timeout for the next chunk: 1 got one, 0 timed out, -1 closed and drained
+    int pop(std::string &chunk, std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!cv.wait_for(lock, timeout, [this]()
+                         { return closed || !chunks.empty(); }))
+        {
+            return 0;
+        }
+        if (chunks.empty())
+        {
+            return -1;
+        }
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        return 1;
+    }
+};
+
+// Span tracing (--trace): every thread records finished spans into a ring buffer of its own,
+// so recording takes no lock. GET /debug/trace copies the rings out as Chrome trace-event JSON
+// (chrome://tracing, ui.perfetto.dev). Batch engine spans also go on one track per sequence,
+// which shows how concurrent requests share the engine steps.
+struct trace_event
+{
+    const char *name;     // string literal
+    int64_t ts_us;        // start, since tracing.epoch
+    int64_t dur_us;
+    uint64_t request_id;  // 0: none
+    int slot;             // batch engine sequence, -1: none
+    int track;            // -1: the recording thread's own
+    const char *arg_name; // stage specific count (tiles, tokens, bytes), nullptr: none
+    int64_t arg;
+};
+
+struct trace_ring
+{
+    int tid = 0;
+    std::string thread_name;
+    std::vector<trace_event> events;   // power of two
+    std::atomic<uint64_t> n_written{0}; // published by the owner thread only
+};
+
+struct trace_state
+{
+    bool enabled = false;    // set before any thread starts
+    size_t ring_size = 4096; // events per thread (--trace-events)
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex mutex; // ring registration and export, never taken to record
+    std::vector<std::unique_ptr<trace_ring>> rings;
+    std::vector<trace_ring *> free_rings; // of exited threads, their events stay until reused
+};
+trace_state tracing;
+std::atomic<uint64_t> next_request_id{1};
+
+// Connection threads come and go with requests: a thread's ring is returned when it exits
+// and handed to the next new thread, so memory stays bounded by the threads alive at once
+struct trace_thread
+{
+    trace_ring *ring = nullptr;
+    std::string name = "request"; // set by long-lived threads before their first span
+    ~trace_thread();
+};
+thread_local trace_thread trace_local;
+thread_local uint64_t trace_request = 0; // request the current thread works on, for spans deep in the call tree
+
+static int64_t trace_now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tracing.epoch).count();
+}
+
+static trace_ring *trace_acquire_ring()
+{
+    std::lock_guard<std::mutex> lock(tracing.mutex);
+    trace_ring *ring;
+    if (!tracing.free_rings.empty())
+    {
+        ring = tracing.free_rings.back();
+        tracing.free_rings.pop_back();
+    }
+    else
+    {
+        tracing.rings.push_back(std::unique_ptr<trace_ring>(new trace_ring()));
+        ring = tracing.rings.back().get();
+        ring->tid = (int)tracing.rings.size();
+        ring->events.resize(tracing.ring_size);
+    }
+    ring->thread_name = trace_local.name;
+    return ring;
+}
+
+trace_thread::~trace_thread()
+{
+    if (ring)
+    {
+        std::lock_guard<std::mutex> lock(tracing.mutex);
+        tracing.free_rings.push_back(ring);
+    }
+}
+
+static void trace_record(const char *name, int64_t ts_us, int64_t dur_us, uint64_t request_id, int slot = -1,
+                         const char *arg_name = nullptr, int64_t arg = 0, int track = -1)
+{
+    trace_ring *ring = trace_local.ring;
+    if (!ring)
+    {
+        ring = trace_local.ring = trace_acquire_ring();
+    }
+    const uint64_t n = ring->n_written.load(std::memory_order_relaxed);
+    ring->events[n & (ring->events.size() - 1)] = {name, ts_us, dur_us, request_id, slot, track, arg_name, arg};
+    ring->n_written.store(n + 1, std::memory_order_release);
+}
+
+// Times its scope, or up to end(); the span is recorded when it ends
+struct trace_span
+{
+    const char *name;
+    uint64_t request_id;
+    int slot;
+    const char *arg_name;
+    int64_t arg;
+    int64_t ts_us;
+    bool open;
+
+    trace_span(const char *name, uint64_t request_id, int slot = -1, const char *arg_name = nullptr, int64_t arg = 0)
+        : name(name), request_id(request_id), slot(slot), arg_name(arg_name), arg(arg),
+          ts_us(tracing.enabled ? trace_now_us() : 0), open(tracing.enabled) {}
+    trace_span(const trace_span &) = delete;
+    trace_span &operator=(const trace_span &) = delete;
+    ~trace_span() { end(); }
+
+    void end()
+    {
+        if (open)
+        {
+            trace_record(name, ts_us, trace_now_us() - ts_us, request_id, slot, arg_name, arg);
+            open = false;
+        }
+    }
+};
+
+// Server metrics, exposed in Prometheus text format on GET /metrics
+struct server_metrics
+{
+    std::atomic<uint64_t> requests_total{0};
+    std::atomic<uint64_t> requests_cancelled_total{0};
+    std::atomic<uint64_t> embedded_images_total{0};
+    std::atomic<uint64_t> spec_drafted_total[SPEC_COUNT] = {};
+    std::atomic<uint64_t> spec_accepted_total[SPEC_COUNT] = {};
+    std::atomic<uint64_t> sampled_tokens_total{0};
+    std::atomic<uint64_t> sampling_ns_total{0};
+    std::atomic<uint64_t> batch_steps_total{0};
+    std::atomic<uint64_t> batch_decode_tokens_total{0};
+    std::atomic<uint64_t> batch_prefill_tokens_total{0};
+
+    // time between two decode steps of the same sequence
+    static constexpr double tbt_buckets[] = {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5};
+    static constexpr int n_tbt_buckets = sizeof(tbt_buckets) / sizeof(tbt_buckets[0]);
+    std::atomic<uint64_t> tbt_count[n_tbt_buckets + 1] = {}; // last: +Inf
+    std::atomic<uint64_t> tbt_sum_us{0};
+
+    void observe_time_between_tokens(double seconds)
+    {
+        int bucket = 0;
+        while (bucket < n_tbt_buckets && seconds > tbt_buckets[bucket])
+        {
+            bucket++;
+        }
+        tbt_count[bucket]++;
+        tbt_sum_us += (uint64_t)(seconds * 1e6);
+    }
+    std::string isa_level; // set once at startup
+    int numa_node = 0;
+};
+server_metrics metrics;
+
+// Admission control. Every admitted request adds its estimated vision and text lane cost to
+// the backlog of its priority class until it finishes; the estimates come from moving
+// averages of the measured stage costs. A request only waits for its own and higher classes.
+// It is turned away with 503 when --max-queue requests are already in, with 429 when the
+// time until its text stage could start exceeds --queue-slo-ms, and with 504 when it can not
+// finish before its deadline.
+struct admission_control
+{
+    std::mutex mutex;
+    int max_queue = 64;
+    double slo_ms = 30000; // 0 disables the estimate check
+    int n_admitted = 0;
+    double vision_backlog_ms[PRIORITY_COUNT] = {};
+    double text_backlog_ms[PRIORITY_COUNT] = {};
+
+    // moving averages, the text ones are seeded by the startup test prompt
+    double vision_ms = 1000; // CLIP encode per image
+    double prefill_ms_per_token = 10;
+    double decode_ms_per_token = 100;
+    double generated_tokens = 128; // response length
+
+    std::atomic<uint64_t> rejected_queue_full{0};
+    std::atomic<uint64_t> rejected_slo{0};
+    std::atomic<uint64_t> rejected_deadline{0}; // at arrival or when dispatched
+};
+admission_control admission;
+
+// Weighted fair sharing between API keys (start-time fair queuing over the estimated request
+// cost). A key's requests are tagged back to back in virtual time, scaled by its weight
+// (--api-key-weight); the virtual clock follows the start tags of dispatched jobs.
+struct fair_share
+{
+    std::mutex mutex;
+    double vtime = 0;
+    std::unordered_map<std::string, double> finish; // last finish tag per key, pruned in fair_share_order
+    size_t prune_at = 64;                           // finish size that triggers the next prune
+    std::unordered_map<std::string, double> weights;
+};
+fair_share fairness;
+
+// Estimated cost of one admitted request, returned to the backlog when it finishes
+struct admission_ticket
+{
+    bool admitted = false;
+    priority_class priority = PRIORITY_INTERACTIVE;
+    int status = 0; // 429, 503 or 504 when rejected
+    int retry_after_s = 0;
+    double wait_ms = 0;
+    double vision_ms = 0;
+    double text_ms = 0;
+};
+
+// Persistent compute lane. Every lane owns worker threads pinned to its cores and runs
+// jobs by job_order, submission order breaking ties. The text lane has one worker, the vision
+// lane one per --vision-workers, each on its share of the cores with a clip_state of its own. ggml starts its graph compute threads from the calling thread,
+// and those inherit the affinity mask, so CLIP (vision lane) and LLM (text lane) work stay
+// on disjoint cores instead of oversubscribing all of them. Running all llama_decode calls
+// on the text lane also serializes access to the shared llama context.
+struct lane_job
+{
+    job_order order;
+    uint64_t seq;
+    std::function<void()> fn;
+};
+
+struct compute_lane
+{
+    std::string name;
+    std::vector<int> cpus;
+    int n_threads = 1; // per worker
+    int spin_us = 0; // busy-wait this long for the next job before parking on the condvar
+
+    std::vector<std::thread> workers; // all take jobs from the one queue
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<lane_job> jobs;
+    uint64_t n_submitted = 0;
+    std::atomic<int> n_pending{0};
+    bool stopping = false; // workers exit once the queue is empty, under mutex
+};
+compute_lane vision_lane;
+compute_lane text_lane;
+thread_local int lane_worker_index = 0; // worker of its lane the current thread is
+
+// CLIP compute state of each vision worker over the shared clip_ctx weights, null for the
+// first worker, which uses the clip_ctx's own
+std::vector<struct clip_state *> clip_states;
+
+// Optional draft model for speculative decoding (--draft-model). It shares the tokenizer
+// with the main model, sees the text part of the prompt and proposes n_draft tokens per step.
+// Used from the text lane only.
+struct draft_model
+{
+    struct llama_model *model = nullptr;
+    struct llama_context *ctx = nullptr;
+    llama_batch batch;
+    int n_draft = 5;
+    int n_past = 0;      // tokens of the current sequence in the draft KV cache
+    size_t n_synced = 0; // generated tokens already evaluated by the draft
+    struct text_slot *owner = nullptr; // request the draft currently follows
+};
+draft_model draft;
+
+// One part of a prompt: text tokens or an image embedding of n_pos rows
+struct prompt_segment
+{
+    std::vector<llama_token> tokens;
+    const float *embd = nullptr; // n_pos * n_embd floats, owned by the caller
+    int n_pos = 0;
+
+    int size() const { return embd ? n_pos : (int)tokens.size(); }
+};
+
+// Continuous batching on the text lane. Every running request owns a sequence of the shared
+// llama context (--parallel). Each step decodes one position (plus speculative ones) of every
+// generating sequence together with prompt chunks of the sequences still in prefill, limited
+// to --batch-tokens, so a long image prefill never holds up the others for more than a step.
+struct batch_engine
+{
+    int n_ctx_slot = 0;     // context of one sequence
+    int n_budget = 256;     // positions per step
+    std::vector<int> free_seqs;
+    std::vector<struct text_slot *> active; // in admission order
+    llama_batch batch;      // token rows
+    llama_batch embd_batch; // image embedding rows
+    bool running = false;
+    bool wake = false; // a waiting sequence got its input, under text_lane.mutex
+};
+batch_engine engine;
+
 // Forward declarations
-std::string process_request(const std::string &request_body);
-std::string generate_image_description(const std::string &image_data, const std::string &system_message, const std::string &user_message);
+std::string process_request(const std::string &request_headers, const std::string &request_body, int client_socket);
+std::string process_embeddings_request(const std::string &request_headers, const std::string &request_body, int client_socket);
+#ifdef LLAVA_BATCH
+int run_batch(const std::string &input_path, const std::string &output_path, int max_inflight);
+#endif
+bool send_all(int socket, const std::string &data);
+bool peer_closed(int socket);
+void build_piece_table(const struct llama_model *model);
+std::string metrics_response();
+std::string clip_profile_response();
+bool write_clip_profile(const std::string &path);
+std::string trace_response();
+bool write_trace(const std::string &path);
+void llava_trace_span(const char *stage, int index, int count, int64_t duration_us, void *user_data);
+admission_ticket admission_request(priority_class priority, double deadline_ms, int n_images, int n_prompt_tokens, int n_predict);
+job_order fair_share_order(const std::string &api_key, priority_class priority, double deadline_ms, double cost_ms);
+void admission_release(const admission_ticket &ticket, const generation_result &result);
+void admission_observe(const generation_result &result);
+void lane_start(compute_lane &lane, const std::string &name, const std::vector<int> &cpus, int n_threads, int spin_us, int n_workers = 1);
+void lane_stop(compute_lane &lane);
+void lane_submit(compute_lane &lane, std::function<void()> job, const job_order &order);
+bool lane_try_pop(compute_lane &lane, std::function<void()> &job);
+std::vector<int> allowed_cpus();
+
+// CPU topology from sysfs, restricted to the CPUs this process may run on
+struct cpu_info
+{
+    int cpu;
+    int package;     // socket
+    int core;        // core id within the package
+    int node;        // NUMA node
+    bool efficiency; // E-core on hybrid parts
+};
+
+struct cpu_topology
+{
+    std::vector<int> nodes;     // NUMA nodes with at least one allowed CPU
+    std::vector<cpu_info> cpus; // ascending
+};
+
+cpu_topology read_cpu_topology();
+std::vector<int> node_cpus(const cpu_topology &topology, int node, int *n_physical);
+bool bind_memory_to_node(int node);
+int spawn_numa_instances(const std::vector<int> &nodes);
+
+// Run fn on the lane, the future yields its result
+template <typename F>
+auto lane_async(compute_lane &lane, F fn, const job_order &order = job_order()) -> std::future<decltype(fn())>
+{
+    auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+    auto result = task->get_future();
+    lane_submit(lane, [task]()
+                { (*task)(); }, order);
+    return result;
+}
+
+// Run fn on the lane and wait for its result
+template <typename F>
+auto lane_run(compute_lane &lane, F fn, const job_order &order = job_order()) -> decltype(fn())
+{
+    return lane_async(lane, std::move(fn), order).get();
+}
+generation_result generate_response(const std::vector<image_input> &images, const std::string &system_message, const std::vector<std::string> &user_texts, const generation_params &params);
+generation_result generate_image_description(const std::vector<image_input> &images, const std::string &system_message, const std::vector<std::string> &user_texts, const generation_params &params);
 std::string base64_decode(const std::string &encoded_string);
-std::string generate_text_response(const std::string &system_message, const std::string &user_message);
+std::string base64_encode(const void *data, size_t size);
+generation_result generate_text_response(const std::string &system_message, const std::string &user_message, const generation_params &params);
+generation_result generate_sequence(std::vector<prompt_segment> prompt, const generation_params &params);
+static bool tokenize_image_prompt(const std::string &system_message, const std::vector<std::string> &user_texts, std::vector<prompt_segment> &segments);
+
+// Image embeddings made on the vision lane, freed with the object
+struct image_embeddings
+{
+    std::vector<float *> embd; // n_pos[i] * n_embd floats each
+    std::vector<int> n_pos;
+    double vision_ms = 0;
+    bool missed_deadline = false;
+
+    ~image_embeddings();
+};
+
+static size_t decode_images(const std::vector<image_input> &images, std::vector<struct clip_image_u8 *> &clip_images);
+static void free_images(std::vector<struct clip_image_u8 *> &clip_images);
+static bool encode_images(const std::vector<struct clip_image_u8 *> &clip_images, const generation_params &params, image_embeddings &out,
+                          const std::function<void()> &on_start = nullptr);
 
 // Main function
 int main(int argc, char *argv[])
@@ -48,6 +608,23 @@ int main(int argc, char *argv[])
     // Parse command line arguments
     std::string model_path, mmproj_path;
     int port = 8080;
+    bool clip_flash_attn = false;
+    clip_profile_mode clip_profile = CLIP_PROFILE_NONE;
+    std::string clip_profile_path;
+    int n_threads_text = 0;   // 0: derived from cpu_get_num_math()
+    int n_threads_vision = 0;
+    int n_vision_workers = 1;
+    int spin_us = 50;
+    int numa_node = -1; // -1: first node with allowed CPUs
+    bool numa_instances = false;
+    std::string draft_model_path;
+    int n_parallel = 2;
+    int n_ctx = 8192;
+#ifdef LLAVA_BATCH
+    std::string batch_input, batch_output;
+    int batch_inflight = 0; // 0: twice --parallel
+    std::string trace_path;
+#endif
 
     for (int i = 1; i < argc; i++)
     {
@@ -63,24 +640,270 @@ int main(int argc, char *argv[])
         {
             port = std::stoi(argv[++i]);
         }
+        else if (std::string(argv[i]) == "--clip-flash-attn")
+        {
+            clip_flash_attn = true;
+        }
+        else if (std::string(argv[i]) == "--clip-profile" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            if (mode != "blocks" && mode != "nodes")
+            {
+                std::cerr << "Unsupported --clip-profile mode '" << mode << "', expected blocks or nodes" << std::endl;
+                return 1;
+            }
+            clip_profile = mode == "nodes" ? CLIP_PROFILE_NODES : CLIP_PROFILE_BLOCKS;
+        }
+        else if (std::string(argv[i]) == "--clip-profile-file" && i + 1 < argc)
+        {
+            clip_profile_path = argv[++i];
+        }
+        else if (std::string(argv[i]) == "--allow-half-close")
+        {
+            allow_half_close = true;
+        }
+        else if (std::string(argv[i]) == "--trace")
+        {
+            tracing.enabled = true;
+        }
+        else if (std::string(argv[i]) == "--trace-events" && i + 1 < argc)
+        {
+            // rounded up to a power of two, the ring index is a mask
+            size_t n = std::max(16, std::stoi(argv[++i]));
+            tracing.ring_size = 16;
+            while (tracing.ring_size < n)
+            {
+                tracing.ring_size *= 2;
+            }
+        }
+        else if (std::string(argv[i]) == "--threads-text" && i + 1 < argc)
+        {
+            n_threads_text = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "--threads-vision" && i + 1 < argc)
+        {
+            n_threads_vision = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "--vision-workers" && i + 1 < argc)
+        {
+            n_vision_workers = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--spin-us" && i + 1 < argc)
+        {
+            spin_us = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "--numa-node" && i + 1 < argc)
+        {
+            numa_node = std::stoi(argv[++i]);
+        }
+        else if (std::string(argv[i]) == "--numa-instances")
+        {
+            numa_instances = true;
+        }
+        else if (std::string(argv[i]) == "--draft-model" && i + 1 < argc)
+        {
+            draft_model_path = argv[++i];
+        }
+        else if (std::string(argv[i]) == "--draft-n" && i + 1 < argc)
+        {
+            draft.n_draft = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--parallel" && i + 1 < argc)
+        {
+            n_parallel = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--ctx-size" && i + 1 < argc)
+        {
+            n_ctx = std::max(512, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--vision-batch" && i + 1 < argc)
+        {
+            clip_batch_max = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--batch-tokens" && i + 1 < argc)
+        {
+            engine.n_budget = std::max(16, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--max-queue" && i + 1 < argc)
+        {
+            admission.max_queue = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--queue-slo-ms" && i + 1 < argc)
+        {
+            admission.slo_ms = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--api-key-weight" && i + 1 < argc)
+        {
+            // <key>=<weight>, repeatable
+            std::string arg = argv[++i];
+            size_t eq = arg.rfind('=');
+            if (eq != std::string::npos && eq > 0)
+            {
+                fairness.weights[arg.substr(0, eq)] = std::max(0.01, std::stod(arg.substr(eq + 1)));
+            }
+        }
+#ifdef LLAVA_BATCH
+        else if (std::string(argv[i]) == "--input" && i + 1 < argc)
+        {
+            batch_input = argv[++i];
+        }
+        else if (std::string(argv[i]) == "--output" && i + 1 < argc)
+        {
+            batch_output = argv[++i];
+        }
+        else if (std::string(argv[i]) == "--inflight" && i + 1 < argc)
+        {
+            batch_inflight = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--trace-file" && i + 1 < argc)
+        {
+            trace_path = argv[++i];
+            tracing.enabled = true;
+        }
+#endif
     }
 
+#ifdef LLAVA_BATCH
+    if (model_path.empty() || mmproj_path.empty() || batch_input.empty() || batch_output.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " --model <path> --mmproj <path> --input <requests.jsonl> --output <results.jsonl>"
+                  << " [--inflight <n>] [--clip-flash-attn] [--clip-profile <blocks|nodes>] [--clip-profile-file <path>] [--trace-file <path>] [--trace-events <n>]"
+                  << " [--threads-text <n>] [--threads-vision <n>] [--vision-workers <n>]"
+                  << " [--spin-us <us>] [--numa-node <n>] [--draft-model <path>] [--draft-n <n>]"
+                  << " [--parallel <n>] [--ctx-size <n>] [--batch-tokens <n>] [--vision-batch <n>]" << std::endl;
+        return 1;
+    }
+#endif
     if (model_path.empty() || mmproj_path.empty())
     {
-        std::cerr << "Usage: " << argv[0] << " --model <path> --mmproj <path> [--port <port>]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " --model <path> --mmproj <path> [--port <port>] [--clip-flash-attn]"
+                  << " [--clip-profile <blocks|nodes>] [--clip-profile-file <path>] [--trace] [--trace-events <n>] [--allow-half-close]"
+                  << " [--threads-text <n>] [--threads-vision <n>] [--vision-workers <n>] [--spin-us <us>]"
+                  << " [--numa-node <n>] [--numa-instances] [--draft-model <path>] [--draft-n <n>]"
+                  << " [--parallel <n>] [--ctx-size <n>] [--batch-tokens <n>] [--vision-batch <n>]"
+                  << " [--max-queue <n>] [--queue-slo-ms <ms>] [--api-key-weight <key>=<weight>]" << std::endl;
         return 1;
     }
 
+    // LLAVA_ISA_LEVEL is exported by the llava-server launcher in LLAVA_ISA_DISPATCH builds
+    const char *isa_level = std::getenv("LLAVA_ISA_LEVEL");
+    metrics.isa_level = isa_level ? isa_level : "default";
+    std::cout << "ISA level: " << metrics.isa_level << std::endl;
+
+    if (tracing.enabled)
+    {
+        llava_set_trace_callback(llava_trace_span, nullptr);
+        std::cout << "Tracing: " << tracing.ring_size << " events per thread, see GET /debug/trace" << std::endl;
+    }
+
+    // NUMA placement: the whole engine (threads, weights, KV cache) lives on one node. With
+    // --numa-instances every node gets its own forked server, all sharing the port.
+    cpu_topology topology = read_cpu_topology();
+    if (numa_instances && topology.nodes.size() > 1)
+    {
+        numa_node = spawn_numa_instances(topology.nodes);
+        if (numa_node < 0)
+        {
+            return 0; // parent, all instances exited
+        }
+    }
+    if (numa_node < 0 || std::find(topology.nodes.begin(), topology.nodes.end(), numa_node) == topology.nodes.end())
+    {
+        if (numa_node >= 0)
+        {
+            std::cerr << "Warning: NUMA node " << numa_node << " has no usable CPUs" << std::endl;
+        }
+        numa_node = topology.nodes.empty() ? 0 : topology.nodes[0];
+    }
+    metrics.numa_node = numa_node;
+
+    // Model and KV memory is allocated from this thread and the lanes started below, which
+    // inherit the policy
+    if (topology.nodes.size() > 1 && !bind_memory_to_node(numa_node))
+    {
+        std::cerr << "Warning: failed to bind memory to NUMA node " << numa_node << std::endl;
+    }
+
+    // Split the cores between the text and the vision lane. Without explicit counts both get
+    // half of the node's physical cores; the text lane takes the first cores. SMT siblings
+    // and efficiency cores are only used when more threads are requested.
+    int n_math = 0;
+    std::vector<int> cpus = node_cpus(topology, numa_node, &n_math);
+    if (cpus.empty())
+    {
+        cpus = allowed_cpus();
+        n_math = cpu_get_num_math();
+    }
+    n_math = std::max(1, n_math);
+    std::cout << "NUMA node " << numa_node << ": " << n_math << " physical cores, " << cpus.size() << " CPUs" << std::endl;
+    if (n_threads_text <= 0 && n_threads_vision <= 0)
+    {
+        n_threads_vision = std::max(1, n_math / 2);
+        n_threads_text = std::max(1, n_math - n_threads_vision);
+    }
+    else if (n_threads_text <= 0)
+    {
+        n_threads_text = std::max(1, n_math - n_threads_vision);
+    }
+    else if (n_threads_vision <= 0)
+    {
+        n_threads_vision = std::max(1, n_math - n_threads_text);
+    }
+
+    if (n_threads_text + n_threads_vision > (int)cpus.size())
+    {
+        std::cerr << "Warning: " << n_threads_text + n_threads_vision << " lane threads on " << cpus.size()
+                  << " CPUs, text and vision lanes will share cores" << std::endl;
+    }
+    std::vector<int> text_cpus, vision_cpus;
+    for (int i = 0; i < n_threads_text; i++)
+    {
+        text_cpus.push_back(cpus[i % cpus.size()]);
+    }
+    for (int i = 0; i < n_threads_vision; i++)
+    {
+        vision_cpus.push_back(cpus[(n_threads_text + i) % cpus.size()]);
+    }
+    lane_start(text_lane, "text", text_cpus, n_threads_text, spin_us);
+    lane_start(vision_lane, "vision", vision_cpus, n_threads_vision, spin_us, n_vision_workers);
+    // every return from here on joins the lane workers first
+    struct lanes_guard
+    {
+        ~lanes_guard()
+        {
+            lane_stop(vision_lane);
+            lane_stop(text_lane);
+        }
+    } lanes;
+
     // Initialize CLIP
-    clip_ctx = clip_model_load(mmproj_path.c_str(), 1);
+    clip_model_params clip_params = clip_model_default_params();
+    clip_params.use_flash_attn = clip_flash_attn;
+    clip_ctx = clip_model_load_with_params(mmproj_path.c_str(), clip_params);
     if (!clip_ctx)
     {
         std::cerr << "Failed to load CLIP model" << std::endl;
         return 1;
     }
+    if (clip_profile == CLIP_PROFILE_NONE && !clip_profile_path.empty())
+    {
+        clip_profile = CLIP_PROFILE_BLOCKS;
+    }
+    if (clip_profile != CLIP_PROFILE_NONE)
+    {
+        clip_set_profile(clip_ctx, clip_profile);
+        std::cout << "CLIP profiling: " << (clip_profile == CLIP_PROFILE_NODES ? "per node" : "per block")
+                  << ", see GET /debug/clip-profile" << std::endl;
+    }
+    clip_states.assign(vision_lane.workers.size(), nullptr);
+    for (size_t w = 1; w < clip_states.size(); w++)
+    {
+        clip_states[w] = clip_state_init(clip_ctx);
+    }
 
     // Initialize LLaMA
     llama_backend_init();
+    std::cout << "System info: " << llama_print_system_info() << std::endl;
 
     llama_model_params model_params = llama_model_default_params();
     model_params.n_gpu_layers = -1; // for 7B model, adjust based on your model size
@@ -93,8 +916,15 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // One KV cache shared by all sequences, --ctx-size split evenly between them. A batch
+    // holds the prompt budget plus every sequence's decode and speculative positions.
+    const int n_batch = engine.n_budget + n_parallel * (1 + std::max(64, draft.n_draft));
     llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = 2048; // adjust as needed
+    ctx_params.n_ctx = n_ctx;
+    ctx_params.n_seq_max = n_parallel;
+    ctx_params.n_batch = n_batch;
+    ctx_params.n_threads = text_lane.n_threads;
+    ctx_params.n_threads_batch = text_lane.n_threads;
     llama_ctx = llama_new_context_with_model(llama_model, ctx_params);
 
     if (llama_ctx == NULL)
@@ -103,37 +933,123 @@ int main(int argc, char *argv[])
         llama_free_model(llama_model);
         return 1;
     }
-
-    // Set up server socket
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1)
+    if (!llava_validate_embed_size(llama_ctx, clip_ctx))
     {
-        std::cerr << "Failed to create socket" << std::endl;
+        llama_free(llama_ctx);
+        llama_free_model(llama_model);
         return 1;
     }
 
-    sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    // Draft model for speculative decoding, on the text lane's threads like the main model
+    if (!draft_model_path.empty())
     {
-        std::cerr << "Failed to bind to port " << port << std::endl;
-        return 1;
+        draft.model = llama_load_model_from_file(draft_model_path.c_str(), model_params);
+        if (draft.model == NULL)
+        {
+            fprintf(stderr, "%s: error: unable to load draft model '%s'\n", __func__, draft_model_path.c_str());
+            return 1;
+        }
+        if (llama_n_vocab(draft.model) != llama_n_vocab(llama_model))
+        {
+            fprintf(stderr, "%s: error: draft model vocab (%d) does not match the model (%d)\n", __func__,
+                    llama_n_vocab(draft.model), llama_n_vocab(llama_model));
+            return 1;
+        }
+        llama_context_params draft_params = ctx_params;
+        draft_params.n_ctx = n_ctx / n_parallel;
+        draft_params.n_seq_max = 1;
+        draft.ctx = llama_new_context_with_model(draft.model, draft_params);
+        if (draft.ctx == NULL)
+        {
+            fprintf(stderr, "%s: error: failed to create draft context\n", __func__);
+            return 1;
+        }
+        draft.batch = llama_batch_init(std::max<int>(ctx_params.n_batch, draft.n_draft + 1), 0, 1);
+        std::cout << "Speculative decoding with draft model " << draft_model_path << ", " << draft.n_draft << " tokens per step" << std::endl;
     }
 
-    if (listen(server_fd, 3) < 0)
+    engine.n_ctx_slot = llama_n_ctx(llama_ctx) / n_parallel;
+    for (int seq = n_parallel - 1; seq >= 0; seq--)
     {
-        std::cerr << "Failed to listen on socket" << std::endl;
-        return 1;
+        engine.free_seqs.push_back(seq);
     }
+    engine.batch = llama_batch_init(n_batch, 0, 1);
+    engine.embd_batch = llama_batch_init(engine.n_budget, llama_n_embd(llama_model), 1);
+    std::cout << "Batch engine: " << n_parallel << " sequences of " << engine.n_ctx_slot << " positions, "
+              << engine.n_budget << " prompt positions per step" << std::endl;
+
+#ifdef LLAVA_BATCH
+    build_piece_table(llama_model);
+    const int batch_status = run_batch(batch_input, batch_output, batch_inflight > 0 ? batch_inflight : 2 * n_parallel);
+    if (!clip_profile_path.empty() && !write_clip_profile(clip_profile_path))
+    {
+        std::cerr << "Failed to write the CLIP profile to " << clip_profile_path << std::endl;
+    }
+    if (!trace_path.empty() && !write_trace(trace_path))
+    {
+        std::cerr << "Failed to write the trace to " << trace_path << std::endl;
+    }
+    return batch_status;
+#endif
+
+    // The profile file is rewritten every few seconds, so it survives the server being killed
+    if (!clip_profile_path.empty())
+    {
+        std::thread([clip_profile_path]()
+                    {
+            bool warned = false;
+            while (true)
+            {
+                std::this_thread::sleep_for(std::chrono::seconds(10));
+                if (!write_clip_profile(clip_profile_path) && !warned)
+                {
+                    std::cerr << "Failed to write the CLIP profile to " << clip_profile_path << std::endl;
+                    warned = true;
+                }
+            } })
+            .detach();
+    }
+
+    // Set up server socket
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1)
+    {
+        std::cerr << "Failed to create socket" << std::endl;
+        return 1;
+    }
+
+    sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (numa_instances)
+    {
+        // one listening socket per instance, the kernel spreads connections over them
+        int reuse = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        std::cerr << "Failed to bind to port " << port << std::endl;
+        return 1;
+    }
+
+    if (listen(server_fd, 3) < 0)
+    {
+        std::cerr << "Failed to listen on socket" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Server listening on port " << port << std::endl;
 
-    std::cout << "Server listening on port " << port << std::endl;
-
     std::cout << "Testing model with a simple prompt..." << std::endl;
-    std::string test_response = generate_text_response("", "Hello, world!");
-    std::cout << "Test response: " << test_response << std::endl;
+    build_piece_table(llama_model);
+
+    generation_result test_response = generate_text_response("", "Hello, world!", generation_params());
+    std::cout << "Test response: " << test_response.text << std::endl;
+    admission_observe(test_response); // first real numbers for the queue time estimate
 
     while (true)
     {
@@ -147,6 +1063,8 @@ int main(int argc, char *argv[])
         // Handle client in a separate thread
         std::thread([client_socket]()
                     {
+            trace_request = next_request_id++;
+            trace_span accept_span("accept", trace_request);
             char buffer[1024] = {0};
             std::string request;
         std::string request_headers;
@@ -185,266 +1103,2958 @@ int main(int argc, char *argv[])
         }
 
 
-            std::string response = process_request(request_body);
+        // Request line: <method> <path> HTTP/1.1
+        std::istringstream request_line(request_headers.substr(0, request_headers.find("\r\n")));
+        std::string method, path;
+        request_line >> method >> path;
+            accept_span.arg_name = "bytes";
+            accept_span.arg = (int64_t)(request_headers.size() + request_body.size());
+            accept_span.end();
+
+            std::string response;
+            if (method == "GET" && path == "/metrics")
+            {
+                response = metrics_response();
+            }
+            else if (method == "GET" && path == "/debug/clip-profile")
+            {
+                response = clip_profile_response();
+            }
+            else if (method == "DELETE" && path == "/debug/clip-profile")
+            {
+                clip_profile_reset(clip_ctx);
+                response = "HTTP/1.1 204 No Content\r\n\r\n";
+            }
+            else if (method == "GET" && path == "/debug/trace")
+            {
+                response = trace_response();
+            }
+            else if (method == "POST" && path == "/v1/images/embeddings")
+            {
+                metrics.requests_total++;
+                response = process_embeddings_request(request_headers, request_body, client_socket);
+            }
+            else
+            {
+                metrics.requests_total++;
+                response = process_request(request_headers, request_body, client_socket);
+            }
 
-            send(client_socket, response.c_str(), response.length(), 0);
+            send_all(client_socket, response);
             close(client_socket); })
             .detach();
+    }
+}
+
+std::string metrics_response()
+{
+    std::ostringstream body;
+    body << "# HELP llava_requests_total Completion requests received.\n"
+         << "# TYPE llava_requests_total counter\n"
+         << "llava_requests_total " << metrics.requests_total.load() << "\n"
+         << "# HELP llava_requests_cancelled_total Requests abandoned because the client disconnected.\n"
+         << "# TYPE llava_requests_cancelled_total counter\n"
+         << "llava_requests_cancelled_total " << metrics.requests_cancelled_total.load() << "\n"
+         << "# HELP llava_embedded_images_total Images encoded for /v1/images/embeddings.\n"
+         << "# TYPE llava_embedded_images_total counter\n"
+         << "llava_embedded_images_total " << metrics.embedded_images_total.load() << "\n"
+         << "# HELP llava_requests_rejected_total Requests turned away by admission control.\n"
+         << "# TYPE llava_requests_rejected_total counter\n"
+         << "llava_requests_rejected_total{reason=\"queue_full\"} " << admission.rejected_queue_full.load() << "\n"
+         << "llava_requests_rejected_total{reason=\"slo\"} " << admission.rejected_slo.load() << "\n"
+         << "llava_requests_rejected_total{reason=\"deadline\"} " << admission.rejected_deadline.load() << "\n"
+         << "# HELP llava_isa_info ISA level the server binary was built for.\n"
+         << "# TYPE llava_isa_info gauge\n"
+         << "llava_isa_info{level=\"" << metrics.isa_level << "\"} 1\n"
+         << "# HELP llava_numa_node NUMA node this server instance is bound to.\n"
+         << "# TYPE llava_numa_node gauge\n"
+         << "llava_numa_node " << metrics.numa_node << "\n";
+
+    body << "# HELP llava_sampled_tokens_total Tokens drawn by the sampler, including rejected speculative positions.\n"
+         << "# TYPE llava_sampled_tokens_total counter\n"
+         << "llava_sampled_tokens_total " << metrics.sampled_tokens_total.load() << "\n"
+         << "# HELP llava_sampling_seconds_total Time spent in the sampler.\n"
+         << "# TYPE llava_sampling_seconds_total counter\n"
+         << "llava_sampling_seconds_total " << metrics.sampling_ns_total.load() / 1e9 << "\n";
+
+    body << "# HELP llava_batch_steps_total Batch engine steps.\n"
+         << "# TYPE llava_batch_steps_total counter\n"
+         << "llava_batch_steps_total " << metrics.batch_steps_total.load() << "\n"
+         << "# HELP llava_batch_tokens_total Positions decoded by the batch engine.\n"
+         << "# TYPE llava_batch_tokens_total counter\n"
+         << "llava_batch_tokens_total{kind=\"decode\"} " << metrics.batch_decode_tokens_total.load() << "\n"
+         << "llava_batch_tokens_total{kind=\"prefill\"} " << metrics.batch_prefill_tokens_total.load() << "\n"
+         << "# HELP llava_time_between_tokens_seconds Time between two decode steps of one sequence.\n"
+         << "# TYPE llava_time_between_tokens_seconds histogram\n";
+    uint64_t tbt_cumulative = 0;
+    for (int i = 0; i <= server_metrics::n_tbt_buckets; i++)
+    {
+        tbt_cumulative += metrics.tbt_count[i].load();
+        body << "llava_time_between_tokens_seconds_bucket{le=\"";
+        if (i < server_metrics::n_tbt_buckets)
+        {
+            body << server_metrics::tbt_buckets[i];
+        }
+        else
+        {
+            body << "+Inf";
+        }
+        body << "\"} " << tbt_cumulative << "\n";
+    }
+    body << "llava_time_between_tokens_seconds_sum " << metrics.tbt_sum_us.load() / 1e6 << "\n"
+         << "llava_time_between_tokens_seconds_count " << tbt_cumulative << "\n";
+
+    body << "# HELP llava_spec_drafted_tokens_total Speculative tokens proposed for verification.\n"
+         << "# TYPE llava_spec_drafted_tokens_total counter\n";
+    for (int mode = SPEC_DRAFT; mode < SPEC_COUNT; mode++)
+    {
+        body << "llava_spec_drafted_tokens_total{mode=\"" << speculative_mode_names[mode] << "\"} " << metrics.spec_drafted_total[mode].load() << "\n";
+    }
+    body << "# HELP llava_spec_accepted_tokens_total Speculative tokens accepted by the main model.\n"
+         << "# TYPE llava_spec_accepted_tokens_total counter\n";
+    for (int mode = SPEC_DRAFT; mode < SPEC_COUNT; mode++)
+    {
+        body << "llava_spec_accepted_tokens_total{mode=\"" << speculative_mode_names[mode] << "\"} " << metrics.spec_accepted_total[mode].load() << "\n";
+    }
+    body << "# HELP llava_spec_acceptance_rate Accepted over proposed speculative tokens since start.\n"
+         << "# TYPE llava_spec_acceptance_rate gauge\n";
+    for (int mode = SPEC_DRAFT; mode < SPEC_COUNT; mode++)
+    {
+        const uint64_t drafted = metrics.spec_drafted_total[mode].load();
+        const uint64_t accepted = metrics.spec_accepted_total[mode].load();
+        body << "llava_spec_acceptance_rate{mode=\"" << speculative_mode_names[mode] << "\"} " << (drafted > 0 ? (double)accepted / drafted : 0.0) << "\n";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(admission.mutex);
+        body << "# HELP llava_queue_requests Requests admitted and not finished yet.\n"
+             << "# TYPE llava_queue_requests gauge\n"
+             << "llava_queue_requests " << admission.n_admitted << "\n"
+             << "# HELP llava_queue_backlog_seconds Estimated work admitted to a lane and not finished yet.\n"
+             << "# TYPE llava_queue_backlog_seconds gauge\n";
+        for (int c = 0; c < PRIORITY_COUNT; c++)
+        {
+            body << "llava_queue_backlog_seconds{lane=\"vision\",priority=\"" << priority_class_names[c] << "\"} " << admission.vision_backlog_ms[c] / 1000 << "\n"
+                 << "llava_queue_backlog_seconds{lane=\"text\",priority=\"" << priority_class_names[c] << "\"} " << admission.text_backlog_ms[c] / 1000 << "\n";
+        }
+    }
+
+    std::string response_body = body.str();
+    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(response_body.size()) + "\r\n\r\n" + response_body;
+}
+
+// The CLIP encoder's time per block (or block/op) over all encodes since startup or the last
+// reset, in graph order. share is the entry's part of the summed time.
+static json clip_profile_json()
+{
+    std::vector<clip_profile_entry> entries(256);
+    int n = clip_profile_get(clip_ctx, entries.data(), (int)entries.size());
+    if (n > (int)entries.size())
+    {
+        entries.resize(n);
+        n = std::min(n, clip_profile_get(clip_ctx, entries.data(), n));
+    }
+    entries.resize(n);
+
+    int64_t total_us = 0, n_encodes = 0;
+    for (const clip_profile_entry &entry : entries)
+    {
+        total_us += entry.total_us;
+        n_encodes = std::max(n_encodes, entry.n_calls);
+    }
 
-        return 0;
+    json blocks = json::array();
+    for (const clip_profile_entry &entry : entries)
+    {
+        blocks.push_back({{"name", entry.name},
+                          {"calls", entry.n_calls},
+                          {"total_ms", entry.total_us / 1000.0},
+                          {"mean_ms", entry.n_calls > 0 ? entry.total_us / 1000.0 / entry.n_calls : 0.0},
+                          {"max_ms", entry.max_us / 1000.0},
+                          {"share", total_us > 0 ? (double)entry.total_us / total_us : 0.0}});
     }
+    return {{"encodes", n_encodes}, {"total_ms", total_us / 1000.0}, {"blocks", blocks}};
 }
 
-std::string process_request(const std::string &request_body)
+std::string clip_profile_response()
 {
-    std::cout << "Received request: " << request_body << std::endl;
-    json request;
-    try
+    std::string response_body = clip_profile_json().dump(2);
+    return "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(response_body.size()) + "\r\n\r\n" + response_body;
+}
+
+// Written to a temporary file first, so readers never see half a profile
+bool write_clip_profile(const std::string &path)
+{
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path);
+        out << clip_profile_json().dump(2) << "\n";
+        if (!out)
+        {
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// Per-sequence tracks get thread ids of their own, above any real ring
+static const int trace_slot_tid = 1000000;
+
+// Chrome trace-event JSON of every span still in the rings, as complete ("X") events. Owners
+// keep writing while a ring is copied, so its counter is read before and after the copy and
+// the slots that may have been overwritten in between are dropped.
+static json trace_json()
+{
+    json events = json::array();
+    const int pid = (int)getpid();
+    std::set<int> slots;
+
+    std::lock_guard<std::mutex> lock(tracing.mutex);
+    for (const std::unique_ptr<trace_ring> &ring : tracing.rings)
+    {
+        const uint64_t size = ring->events.size();
+        const uint64_t n_before = ring->n_written.load(std::memory_order_acquire);
+        std::vector<trace_event> copy = ring->events;
+        const uint64_t n_after = ring->n_written.load(std::memory_order_acquire);
+        // the owner may be writing slot n_after already
+        const uint64_t first = n_after + 1 > size ? n_after + 1 - size : 0;
+
+        events.push_back({{"ph", "M"}, {"name", "thread_name"}, {"pid", pid}, {"tid", ring->tid}, {"args", {{"name", ring->thread_name}}}});
+        for (uint64_t i = first; i < n_before; i++)
+        {
+            const trace_event &event = copy[i & (size - 1)];
+            json args = {{"request", event.request_id}};
+            if (event.slot >= 0)
+            {
+                args["slot"] = event.slot;
+            }
+            if (event.arg_name)
+            {
+                args[event.arg_name] = event.arg;
+            }
+            int tid = ring->tid;
+            if (event.track >= 0)
+            {
+                tid = trace_slot_tid + event.track;
+                slots.insert(event.track);
+            }
+            events.push_back({{"ph", "X"}, {"name", event.name}, {"pid", pid}, {"tid", tid},
+                              {"ts", event.ts_us}, {"dur", event.dur_us}, {"args", args}});
+        }
+    }
+    for (int slot : slots)
+    {
+        events.push_back({{"ph", "M"}, {"name", "thread_name"}, {"pid", pid}, {"tid", trace_slot_tid + slot}, {"args", {{"name", "seq " + std::to_string(slot)}}}});
+    }
+    return {{"traceEvents", events}, {"displayTimeUnit", "ms"}};
+}
+
+std::string trace_response()
+{
+    if (!tracing.enabled)
+    {
+        return "HTTP/1.1 404 Not Found\r\nContent-Type: application/json\r\n\r\n{\"error\": \"Tracing is off, start the server with --trace\"}";
+    }
+    std::string response_body = trace_json().dump(-1, ' ', false, json::error_handler_t::replace);
+    return "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(response_body.size()) + "\r\n\r\n" + response_body;
+}
+
+bool write_trace(const std::string &path)
+{
+    std::ofstream out(path);
+    out << trace_json().dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+    return (bool)out;
+}
+
+// llava_trace_callback: CLIP stages of the image encode, reported as they end
+void llava_trace_span(const char *stage, int, int count, int64_t duration_us, void *)
+{
+    const int64_t now_us = trace_now_us();
+    trace_record(stage, now_us - duration_us, duration_us, trace_request, -1, "tiles", count);
+}
+
+// Estimates the request's cost and queue time and admits it if the queue has room and the
+// wait fits the SLO. Admitted tickets have to be handed back to admission_release.
+admission_ticket admission_request(priority_class priority, double deadline_ms, int n_images, int n_prompt_tokens, int n_predict)
+{
+    std::lock_guard<std::mutex> lock(admission.mutex);
+    admission_ticket ticket;
+    ticket.priority = priority;
+
+    ticket.vision_ms = n_images * admission.vision_ms;
+    ticket.text_ms = n_prompt_tokens * admission.prefill_ms_per_token +
+                     std::min<double>(n_predict, admission.generated_tokens) * admission.decode_ms_per_token;
+
+    // the lanes work in parallel: the text stage starts once the text lane drained and the
+    // request's own images went through the vision lane, whose workers share its backlog.
+    // Lower classes do not hold it up.
+    double vision_backlog_ms = 0, text_backlog_ms = 0;
+    for (int c = 0; c <= priority; c++)
+    {
+        vision_backlog_ms += admission.vision_backlog_ms[c];
+        text_backlog_ms += admission.text_backlog_ms[c];
+    }
+    ticket.wait_ms = std::max(text_backlog_ms, vision_backlog_ms / std::max<size_t>(1, vision_lane.workers.size()) + ticket.vision_ms);
+
+    if (admission.n_admitted >= admission.max_queue)
+    {
+        ticket.status = 503;
+        ticket.retry_after_s = std::max(1, (int)std::ceil(text_backlog_ms / admission.n_admitted / 1000));
+        admission.rejected_queue_full++;
+        return ticket;
+    }
+    if (deadline_ms > 0 && steady_ms() + ticket.wait_ms + ticket.text_ms > deadline_ms)
+    {
+        ticket.status = 504;
+        admission.rejected_deadline++;
+        return ticket;
+    }
+    if (admission.n_admitted > 0 && admission.slo_ms > 0 && ticket.wait_ms > admission.slo_ms)
+    {
+        ticket.status = 429;
+        ticket.retry_after_s = std::max(1, (int)std::ceil((ticket.wait_ms - admission.slo_ms) / 1000));
+        admission.rejected_slo++;
+        return ticket;
+    }
+
+    ticket.admitted = true;
+    admission.n_admitted++;
+    admission.vision_backlog_ms[priority] += ticket.vision_ms;
+    admission.text_backlog_ms[priority] += ticket.text_ms;
+    return ticket;
+}
+
+void admission_release(const admission_ticket &ticket, const generation_result &result)
+{
+    {
+        std::lock_guard<std::mutex> lock(admission.mutex);
+        admission.n_admitted--;
+        double &vision_backlog_ms = admission.vision_backlog_ms[ticket.priority];
+        double &text_backlog_ms = admission.text_backlog_ms[ticket.priority];
+        vision_backlog_ms = std::max(0.0, vision_backlog_ms - ticket.vision_ms);
+        text_backlog_ms = std::max(0.0, text_backlog_ms - ticket.text_ms);
+    }
+    admission_observe(result);
+}
+
+// Lane queue position of a new request. Without an explicit deadline the request is due when
+// fair sharing would finish it: the key's queued work plus its own cost, scaled by the weight.
+job_order fair_share_order(const std::string &api_key, priority_class priority, double deadline_ms, double cost_ms)
+{
+    std::lock_guard<std::mutex> lock(fairness.mutex);
+    auto weight = fairness.weights.find(api_key);
+    const double w = weight != fairness.weights.end() ? weight->second : 1.0;
+
+    // A key whose finish tag the virtual clock has passed starts at vtime just like a new one,
+    // so its entry can go. Pruning when the map doubles keeps it to the keys with work in
+    // flight, however many distinct keys clients send, at O(1) amortized per request.
+    if (fairness.finish.size() >= fairness.prune_at)
+    {
+        for (auto it = fairness.finish.begin(); it != fairness.finish.end();)
+        {
+            it = it->second <= fairness.vtime ? fairness.finish.erase(it) : std::next(it);
+        }
+        fairness.prune_at = std::max<size_t>(64, 2 * fairness.finish.size());
+    }
+
+    double &finish = fairness.finish[api_key];
+    job_order order;
+    order.priority = priority;
+    order.vstart = std::max(fairness.vtime, finish);
+    finish = order.vstart + cost_ms / w;
+    order.deadline_ms = deadline_ms > 0 ? deadline_ms : steady_ms() + (finish - fairness.vtime);
+    return order;
+}
+
+// Called by a request's first job on a lane
+static void fair_share_dispatch(const job_order &order)
+{
+    std::lock_guard<std::mutex> lock(fairness.mutex);
+    fairness.vtime = std::max(fairness.vtime, order.vstart);
+}
+
+// Folds the measured stage costs of a finished generation into the moving averages
+void admission_observe(const generation_result &result)
+{
+    if (result.finish_reason != "stop" && result.finish_reason != "length")
+    {
+        return; // errors and cancellations stop early and would skew the costs
+    }
+
+    const double alpha = 0.2;
+    auto update = [alpha](double &average, double sample)
+    { average += alpha * (sample - average); };
+
+    std::lock_guard<std::mutex> lock(admission.mutex);
+    if (result.vision_ms > 0 && result.images_encoded > 0)
+    {
+        update(admission.vision_ms, result.vision_ms / result.images_encoded);
+    }
+    if (result.n_prompt > 0 && result.prefill_ms > 0)
+    {
+        update(admission.prefill_ms_per_token, result.prefill_ms / result.n_prompt);
+    }
+    if (result.n_generated > 0)
+    {
+        update(admission.decode_ms_per_token, result.decode_ms / result.n_generated);
+        update(admission.generated_tokens, result.n_generated);
+    }
+}
+
+// CPUs this process may run on, in ascending order
+std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &mask))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty())
+    {
+        for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+static std::string read_sysfs(const std::string &path)
+{
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    return value;
+}
+
+// Parse a sysfs CPU/node list such as "0-3,8-11"
+static std::vector<int> parse_cpulist(const std::string &list)
+{
+    std::vector<int> result;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        if (range.empty())
+        {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            result.push_back(cpu);
+        }
+    }
+    return result;
+}
+
+cpu_topology read_cpu_topology()
+{
+    cpu_topology topology;
+    std::vector<int> allowed = allowed_cpus();
+
+    std::vector<int> cpu_node(CPU_SETSIZE, 0);
+    if (DIR *dir = opendir("/sys/devices/system/node"))
+    {
+        while (dirent *entry = readdir(dir))
+        {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+            {
+                continue;
+            }
+            for (int cpu : parse_cpulist(read_sysfs("/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist")))
+            {
+                if (cpu < CPU_SETSIZE)
+                {
+                    cpu_node[cpu] = node;
+                }
+            }
+        }
+        closedir(dir);
+    }
+
+    // only hybrid parts have a cpu_atom PMU
+    std::vector<int> atom_cpus = parse_cpulist(read_sysfs("/sys/devices/cpu_atom/cpus"));
+
+    std::set<int> nodes;
+    for (int cpu : allowed)
+    {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        const std::string package = read_sysfs(dir + "physical_package_id");
+        const std::string core = read_sysfs(dir + "core_id");
+
+        cpu_info info;
+        info.cpu = cpu;
+        info.package = package.empty() ? 0 : std::stoi(package);
+        info.core = core.empty() ? cpu : std::stoi(core);
+        info.node = cpu_node[cpu];
+        info.efficiency = std::find(atom_cpus.begin(), atom_cpus.end(), cpu) != atom_cpus.end();
+        topology.cpus.push_back(info);
+        nodes.insert(info.node);
+    }
+    topology.nodes.assign(nodes.begin(), nodes.end());
+    return topology;
+}
+
+// CPUs of a node in the order lanes should use them: one thread per physical performance
+// core, then the SMT siblings, then efficiency cores
+std::vector<int> node_cpus(const cpu_topology &topology, int node, int *n_physical)
+{
+    std::vector<int> primary, siblings, efficiency;
+    std::set<std::pair<int, int>> cores;
+    for (const cpu_info &info : topology.cpus)
+    {
+        if (info.node != node)
+        {
+            continue;
+        }
+        if (info.efficiency)
+        {
+            efficiency.push_back(info.cpu);
+        }
+        else if (cores.insert({info.package, info.core}).second)
+        {
+            primary.push_back(info.cpu);
+        }
+        else
+        {
+            siblings.push_back(info.cpu);
+        }
+    }
+    *n_physical = primary.empty() ? (int)efficiency.size() : (int)primary.size();
+
+    std::vector<int> result = primary;
+    result.insert(result.end(), siblings.begin(), siblings.end());
+    result.insert(result.end(), efficiency.begin(), efficiency.end());
+    return result;
+}
+
+// set_mempolicy(MPOL_BIND) for the calling thread and the threads it creates afterwards.
+// Called through syscall() so the build does not need the libnuma headers.
+bool bind_memory_to_node(int node)
+{
+    const int mpol_bind = 2; // MPOL_BIND in <numaif.h>
+    unsigned long mask[16] = {0};
+    const int bits = 8 * sizeof(unsigned long);
+    if (node < 0 || node >= (int)(sizeof(mask) * 8))
+    {
+        return false;
+    }
+    mask[node / bits] |= 1UL << (node % bits);
+    return syscall(SYS_set_mempolicy, mpol_bind, mask, sizeof(mask) * 8 + 1) == 0;
+}
+
+// Fork one server per NUMA node. Returns the node in the children, -1 in the parent once
+// every instance has exited.
+int spawn_numa_instances(const std::vector<int> &nodes)
+{
+    for (int node : nodes)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            return node;
+        }
+        if (pid < 0)
+        {
+            std::cerr << "Failed to fork instance for NUMA node " << node << std::endl;
+            continue;
+        }
+        std::cout << "Started instance " << pid << " on NUMA node " << node << std::endl;
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0)
+    {
+        std::cerr << "Instance " << pid << " exited with status " << status << std::endl;
+    }
+    return -1;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Takes the next job by job_order, lane.mutex held and the queue not empty
+static void lane_pop_locked(compute_lane &lane, std::function<void()> &job)
+{
+    // the queue is bounded by --max-queue, a scan is cheaper than keeping a heap
+    auto next = std::min_element(lane.jobs.begin(), lane.jobs.end(), [](const lane_job &a, const lane_job &b)
+                                 {
+        if (a.order.priority != b.order.priority)
+        {
+            return a.order.priority < b.order.priority;
+        }
+        if (a.order.deadline_ms != b.order.deadline_ms)
+        {
+            return a.order.deadline_ms < b.order.deadline_ms;
+        }
+        return a.seq < b.seq; });
+    job = std::move(next->fn);
+    lane.jobs.erase(next);
+    lane.n_pending.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// For a job that keeps the lane busy and wants to run what queued up behind it
+bool lane_try_pop(compute_lane &lane, std::function<void()> &job)
+{
+    std::lock_guard<std::mutex> lock(lane.mutex);
+    if (lane.jobs.empty())
+    {
+        return false;
+    }
+    lane_pop_locked(lane, job);
+    return true;
+}
+
+static void lane_worker(compute_lane *lane, int index, std::vector<int> cpus)
+{
+    lane_worker_index = index;
+    trace_local.name = lane->name + "-" + std::to_string(index);
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus)
+    {
+        CPU_SET(cpu, &mask);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+    {
+        std::cerr << "Warning: failed to pin " << lane->name << " lane" << std::endl;
+    }
+
+    while (true)
+    {
+        // Spin first: jobs often arrive back to back (queued images, the generation after an
+        // encode) and parking costs a futex round trip plus a reschedule
+        const auto spin_end = std::chrono::steady_clock::now() + std::chrono::microseconds(lane->spin_us);
+        while (lane->n_pending.load(std::memory_order_acquire) == 0 && std::chrono::steady_clock::now() < spin_end)
+        {
+            cpu_relax();
+        }
+
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(lane->mutex);
+            lane->cv.wait(lock, [lane]()
+                          { return !lane->jobs.empty() || lane->stopping; });
+            if (lane->jobs.empty())
+            {
+                return;
+            }
+            lane_pop_locked(*lane, job);
+        }
+        job();
+    }
+}
+
+// n_threads threads in all, cpus holds one CPU per thread and is split evenly among the workers
+void lane_start(compute_lane &lane, const std::string &name, const std::vector<int> &cpus, int n_threads, int spin_us, int n_workers)
+{
+    n_workers = std::max(1, std::min(n_workers, n_threads));
+    lane.name = name;
+    lane.cpus = cpus;
+    lane.n_threads = n_threads / n_workers;
+    lane.spin_us = std::max(0, spin_us);
+
+    std::cout << "Lane " << name << ": " << n_workers << " x " << lane.n_threads << " threads on CPUs";
+    for (int w = 0; w < n_workers; w++)
+    {
+        std::vector<int> worker_cpus(cpus.begin() + w * lane.n_threads, cpus.begin() + (w + 1) * lane.n_threads);
+        lane.workers.emplace_back(lane_worker, &lane, w, worker_cpus);
+        std::cout << (w ? " |" : "");
+        for (int cpu : worker_cpus)
+        {
+            std::cout << " " << cpu;
+        }
+    }
+    std::cout << std::endl;
+}
+
+// Runs the queued jobs, then joins the workers. std::thread objects that are still joinable
+// at exit would call std::terminate.
+void lane_stop(compute_lane &lane)
+{
+    {
+        std::lock_guard<std::mutex> lock(lane.mutex);
+        lane.stopping = true;
+    }
+    lane.cv.notify_all();
+    for (std::thread &worker : lane.workers)
+    {
+        worker.join();
+    }
+    lane.workers.clear();
+}
+
+void lane_submit(compute_lane &lane, std::function<void()> job, const job_order &order)
+{
+    {
+        std::lock_guard<std::mutex> lock(lane.mutex);
+        lane.jobs.push_back({order, lane.n_submitted++, std::move(job)});
+        lane.n_pending.fetch_add(1, std::memory_order_release);
+    }
+    lane.cv.notify_one();
+}
+
+// Value of a request header, names compare case-insensitively
+static std::string header_value(const std::string &headers, const std::string &name)
+{
+    std::istringstream lines(headers);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        size_t colon = line.find(':');
+        if (colon != name.size() || !std::equal(name.begin(), name.end(), line.begin(), [](char a, char b)
+                                                { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); }))
+        {
+            continue;
+        }
+        size_t begin = line.find_first_not_of(" \t", colon + 1);
+        size_t end = line.find_last_not_of(" \t\r");
+        return begin == std::string::npos ? "" : line.substr(begin, end - begin + 1);
+    }
+    return "";
+}
+
+static const char *deadline_exceeded_response = "HTTP/1.1 504 Gateway Timeout\r\nContent-Type: application/json\r\n\r\n{\"error\": \"Deadline can not be met\"}";
+
+// Image file of a data:image/<any format OpenCV decodes>;base64,<data> URL, or with
+// allow_files (llava-batch, never the server) of a file:// URL
+static bool image_url_bytes(const std::string &image_url, std::string &bytes, bool allow_files = false)
+{
+    if (allow_files && image_url.compare(0, 7, "file://") == 0)
+    {
+        std::ifstream file(image_url.substr(7), std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return file.good() || file.eof();
+    }
+    size_t data_start = image_url.find(";base64,");
+    if (image_url.compare(0, 11, "data:image/") != 0 || data_start == std::string::npos)
+    {
+        return false;
+    }
+    trace_span span("base64", trace_request, -1, "bytes", (int64_t)(image_url.size() - data_start - 8));
+    bytes = base64_decode(image_url.substr(data_start + 8));
+    return true;
+}
+
+// The message may echo client input: dump escapes it, invalid UTF-8 is replaced, not thrown on
+static std::string bad_request_response(const std::string &message)
+{
+    return "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\n\r\n" +
+           json({{"error", message}}).dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+// Hash of the projector weights as 16 hex digits, embeddings only mix between equal ones
+static std::string mmproj_fingerprint()
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)clip_model_fingerprint(clip_ctx));
+    return hex;
+}
+
+// Image embedding computed elsewhere, e.g. a data entry of /v1/images/embeddings with
+// "pooling": "none" from an encode-only node: {"embedding": base64 little-endian f16, "n_pos",
+// "n_embd", "mmproj_fingerprint"}. It has to come from this server's projector, which
+// llava_validate_embed_size checked against the model at startup. Returns an error message.
+static std::string read_image_embedding(const json &embedding, image_input &image)
+{
+    if (!embedding.is_object() || !embedding.contains("embedding") || !embedding["embedding"].is_string() ||
+        !embedding.contains("n_pos") || !embedding["n_pos"].is_number_integer() ||
+        !embedding.contains("n_embd") || !embedding["n_embd"].is_number_integer())
+    {
+        return "Missing or invalid 'image_embedding', expected 'embedding', 'n_pos' and 'n_embd'";
+    }
+    if (!embedding.contains("mmproj_fingerprint") || embedding["mmproj_fingerprint"] != mmproj_fingerprint())
+    {
+        return "Image embedding was not made with this server's projector (mmproj_fingerprint " + mmproj_fingerprint() + ")";
+    }
+    const int n_embd = embedding["n_embd"];
+    const int n_pos = embedding["n_pos"];
+    if (n_embd != clip_n_mmproj_embd(clip_ctx) || n_pos <= 0 || n_pos > engine.n_ctx_slot)
+    {
+        return "Image embedding has shape " + std::to_string(n_pos) + " x " + std::to_string(n_embd) +
+               ", expected n_embd " + std::to_string(clip_n_mmproj_embd(clip_ctx)) + " and at most " + std::to_string(engine.n_ctx_slot) + " positions";
+    }
+    trace_span span("base64", trace_request, -1, "bytes", (int64_t)embedding["embedding"].get_ref<const std::string &>().size());
+    std::string half = base64_decode(embedding["embedding"]);
+    if (half.size() != (size_t)n_pos * n_embd * sizeof(ggml_fp16_t))
+    {
+        return "Image embedding holds " + std::to_string(half.size()) + " bytes, its shape needs " + std::to_string((size_t)n_pos * n_embd * sizeof(ggml_fp16_t));
+    }
+    image.embd.resize((size_t)n_pos * n_embd);
+    ggml_fp16_to_fp32_row((const ggml_fp16_t *)half.data(), image.embd.data(), image.embd.size());
+    image.n_pos = n_pos;
+    return "";
+}
+
+// Scheduling: priority class and deadline from the JSON body or the X-Priority and
+// X-Deadline-Ms headers, the API key for fair sharing from Authorization or X-Api-Key.
+// Returns an error response for an unknown priority class.
+static std::string read_scheduling(const json &request, const std::string &request_headers, generation_params &params, priority_class &priority, std::string &api_key)
+{
+    const double received_ms = steady_ms();
+    std::string priority_name = header_value(request_headers, "X-Priority");
+    if (request.contains("priority") && request["priority"].is_string())
+    {
+        priority_name = request["priority"];
+    }
+    priority = PRIORITY_INTERACTIVE;
+    if (!priority_name.empty())
+    {
+        auto it = std::find(std::begin(priority_class_names), std::end(priority_class_names), priority_name);
+        if (it == std::end(priority_class_names))
+        {
+            return bad_request_response("Unsupported 'priority': " + priority_name);
+        }
+        priority = (priority_class)(it - std::begin(priority_class_names));
+    }
+    std::string deadline = header_value(request_headers, "X-Deadline-Ms");
+    if (request.contains("deadline_ms") && request["deadline_ms"].is_number())
+    {
+        params.deadline_ms = received_ms + request["deadline_ms"].get<double>();
+    }
+    else if (!deadline.empty())
+    {
+        params.deadline_ms = received_ms + std::atof(deadline.c_str());
+    }
+    api_key = header_value(request_headers, "X-Api-Key");
+    std::string authorization = header_value(request_headers, "Authorization");
+    if (authorization.compare(0, 7, "Bearer ") == 0)
+    {
+        api_key = authorization.substr(7);
+    }
+    return "";
+}
+
+// Rejection of a request admission_request did not admit
+static std::string admission_rejected_response(const admission_ticket &ticket)
+{
+    if (ticket.status == 504)
+    {
+        return deadline_exceeded_response;
+    }
+    std::string status = ticket.status == 429 ? "429 Too Many Requests" : "503 Service Unavailable";
+    return "HTTP/1.1 " + status + "\r\nContent-Type: application/json\r\nRetry-After: " + std::to_string(ticket.retry_after_s) +
+           "\r\n\r\n{\"error\": \"Server overloaded, estimated queue time " + std::to_string((int)ticket.wait_ms) + " ms\"}";
+}
+
+// Messages, sampling and speculation settings of an OpenAI chat completion request. Returns
+// an error message for a request that can not be served.
+static std::string parse_chat_request(const json &request, chat_request &chat, bool allow_files = false)
+{
+    if (!request.contains("messages") || !request["messages"].is_array())
+    {
+        return "Missing or invalid 'messages' field";
+    }
+
+    std::string &system_message = chat.system_message;
+    std::vector<std::string> &user_texts = chat.user_texts;
+    std::vector<image_input> &images = chat.images;
+
+    for (const auto &message : request["messages"])
+    {
+        if (!message.is_object() || !message.contains("role") || !message.contains("content"))
+        {
+            continue;
+        }
+
+        std::string role = message["role"];
+
+        if (role == "system" && message["content"].is_string())
+        {
+            system_message = message["content"];
+        }
+        else if (role == "user")
+        {
+            user_texts.assign(1, std::string());
+            images.clear();
+            if (message["content"].is_string())
+            {
+                user_texts[0] = message["content"];
+            }
+            else if (message["content"].is_array())
+            {
+                for (const auto &content : message["content"])
+                {
+                    if (content.contains("type") && content["type"] == "text" && content["text"].is_string())
+                    {
+                        std::string &text = user_texts.back();
+                        text += (text.empty() ? "" : "\n") + content["text"].get<std::string>();
+                    }
+                    else if (content.contains("type") && content["type"] == "image_url")
+                    {
+                        image_input image;
+                        if (!image_url_bytes(content["image_url"]["url"], image.bytes, allow_files))
+                        {
+                            return allow_files ? "Unreadable image URL, expected a base64 data:image or a file:// URL"
+                                               : "Unsupported image URL, expected a base64 data:image URL";
+                        }
+                        images.push_back(std::move(image));
+                        user_texts.emplace_back();
+                    }
+                    else if (content.contains("type") && content["type"] == "image_embedding")
+                    {
+                        image_input image;
+                        std::string error = read_image_embedding(content.value("image_embedding", json()), image);
+                        if (!error.empty())
+                        {
+                            return error;
+                        }
+                        images.push_back(std::move(image));
+                        user_texts.emplace_back();
+                    }
+                }
+            }
+        }
+    }
+
+    // Speculative decoding: the draft model when one is loaded, unless the request picks a mode
+    generation_params &params = chat.params;
+    params.speculative = draft.ctx ? SPEC_DRAFT : SPEC_NONE;
+    if (request.contains("speculative") && request["speculative"].is_string())
+    {
+        std::string mode = request["speculative"];
+        auto it = std::find(std::begin(speculative_mode_names), std::end(speculative_mode_names), mode);
+        if (it == std::end(speculative_mode_names) || (*it == std::string("draft") && !draft.ctx))
+        {
+            return "Unsupported 'speculative' mode: " + mode;
+        }
+        params.speculative = (speculative_mode)(it - std::begin(speculative_mode_names));
+    }
+    for (const char *field : {"max_tokens", "max_completion_tokens"})
+    {
+        if (request.contains(field) && request[field].is_number_integer() && request[field].get<int>() > 0)
+        {
+            params.n_predict = request[field].get<int>();
+        }
+    }
+    if (request.contains("stop"))
+    {
+        const json &stop = request["stop"];
+        if (stop.is_string())
+        {
+            params.stop.push_back(stop.get<std::string>());
+        }
+        else if (stop.is_array())
+        {
+            for (const auto &item : stop)
+            {
+                if (item.is_string())
+                {
+                    params.stop.push_back(item.get<std::string>());
+                }
+            }
+        }
+        params.stop.erase(std::remove(params.stop.begin(), params.stop.end(), std::string()), params.stop.end());
+    }
+
+    sampling_params &sampling = params.sampling;
+    auto read_float = [&request](const char *field, float &value)
+    {
+        if (request.contains(field) && request[field].is_number())
+        {
+            value = request[field].get<float>();
+        }
+    };
+    read_float("temperature", sampling.temperature);
+    read_float("top_p", sampling.top_p);
+    read_float("min_p", sampling.min_p);
+    read_float("presence_penalty", sampling.presence_penalty);
+    read_float("frequency_penalty", sampling.frequency_penalty);
+    read_float("repeat_penalty", sampling.repeat_penalty);
+    if (request.contains("top_k") && request["top_k"].is_number_integer())
+    {
+        sampling.top_k = std::max(0, request["top_k"].get<int>());
+    }
+    if (request.contains("seed") && request["seed"].is_number_integer())
+    {
+        sampling.seed = request["seed"].get<uint32_t>();
+    }
+
+    if (request.contains("speculative_tokens") && request["speculative_tokens"].is_number_integer())
+    {
+        params.n_draft = std::max(1, std::min(64, request["speculative_tokens"].get<int>()));
+    }
+    if (request.contains("speculative_ngram") && request["speculative_ngram"].is_number_integer())
+    {
+        params.ngram_size = std::max(1, std::min(8, request["speculative_ngram"].get<int>()));
+    }
+    return "";
+}
+
+// OpenAI chat.completion object of a finished generation
+static json chat_completion(const generation_result &result)
+{
+    json completion = {
+        {"object", "chat.completion"},
+        {"choices", {{{"index", 0}, {"message", {{"role", "assistant"}, {"content", result.text}}}, {"finish_reason", result.finish_reason}}}},
+        {"usage", {{"prompt_tokens", result.n_prompt}, {"completion_tokens", result.n_generated}, {"total_tokens", result.n_prompt + result.n_generated}}}};
+    if (!result.image_tokens.empty())
+    {
+        completion["usage"]["image_tokens"] = result.image_tokens; // included in prompt_tokens
+    }
+    return completion;
+}
+
+std::string process_request(const std::string &request_headers, const std::string &request_body, int client_socket)
+{
+    std::cout << "Received request: " << request_body << std::endl;
+    trace_span parse_span("parse", trace_request, -1, "bytes", (int64_t)request_body.size());
+    json request;
+    try
+    {
+        request = json::parse(request_body);
+    }
+    catch (json::parse_error &e)
+    {
+        std::string error_msg = "Invalid JSON: " + std::string(e.what()) + ". Request body: " + request_body;
+        return "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\n\r\n{\"error\": \"" + error_msg + "\"}";
+    }
+
+    chat_request chat;
+    std::string error = parse_chat_request(request, chat);
+    if (!error.empty())
+    {
+        return bad_request_response(error);
+    }
+    parse_span.end();
+    generation_params &params = chat.params;
+    params.request_id = trace_request;
+
+    priority_class priority;
+    std::string api_key;
+    std::string scheduling_error = read_scheduling(request, request_headers, params, priority, api_key);
+    if (!scheduling_error.empty())
+    {
+        return scheduling_error;
+    }
+
+    // Admission: tokenizing with no output buffer only counts the prompt tokens
+    std::string prompt = chat.system_message + "\n\nUser: ";
+    for (const std::string &text : chat.user_texts)
+    {
+        prompt += text + "\n";
+    }
+    prompt += "\nAssistant: ";
+    int n_prompt_tokens = -llama_tokenize(llama_model, prompt.c_str(), prompt.length(), nullptr, 0, true, true);
+    int n_encode = 0;
+    for (const image_input &image : chat.images)
+    {
+        n_prompt_tokens += image.precomputed() ? image.n_pos : clip_n_patches(clip_ctx);
+        n_encode += !image.precomputed();
+    }
+    admission_ticket ticket = admission_request(priority, params.deadline_ms, n_encode, n_prompt_tokens, params.n_predict);
+    if (!ticket.admitted)
+    {
+        return admission_rejected_response(ticket);
+    }
+    params.est_vision_ms = ticket.vision_ms;
+    params.est_text_ms = ticket.text_ms;
+    params.order = fair_share_order(api_key, priority, params.deadline_ms, ticket.vision_ms + ticket.text_ms);
+
+    // The generation runs on the lanes while this thread watches the socket. A client that
+    // disconnects cancels it: queued lane jobs are skipped, a running CLIP encode or
+    // llama_decode is aborted and the sequence's KV cells are released.
+    std::atomic<bool> cancelled{false};
+    params.cancel = &cancelled;
+    auto cancel = [&cancelled]()
+    {
+        if (!cancelled.exchange(true))
+        {
+            metrics.requests_cancelled_total++;
+        }
+    };
+    const auto poll_interval = std::chrono::milliseconds(50);
+
+    const bool stream = request.contains("stream") && request["stream"].is_boolean() && request["stream"].get<bool>();
+    if (stream)
+    {
+        // Server-sent events: one chat.completion.chunk per piece of text, written from this
+        // thread while the generation runs on the lanes. The headers wait for the first chunk,
+        // a request dropped for its deadline still gets a plain 504.
+        bool headers_sent = false;
+        auto send_headers = [&]()
+        {
+            if (!headers_sent)
+            {
+                headers_sent = true;
+                return send_all(client_socket, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n");
+            }
+            return true;
+        };
+
+        stream_channel channel;
+        params.on_text = [&channel](const std::string &chunk)
+        { channel.push(chunk); };
+
+        std::future<generation_result> result = std::async(std::launch::async, [&]()
+                                                           {
+            generation_result r = generate_response(chat.images, chat.system_message, chat.user_texts, params);
+            channel.close();
+            return r; });
+
+        bool first = true;
+        size_t n_streamed = 0; // bytes of text sent as content
+        std::string chunk;
+        int status;
+        while ((status = channel.pop(chunk, poll_interval)) >= 0)
+        {
+            if (cancelled)
+            {
+                continue; // drain until the generation notices
+            }
+            if (status == 0)
+            {
+                if (peer_closed(client_socket))
+                {
+                    cancel();
+                }
+                continue;
+            }
+
+            n_streamed += chunk.size();
+            json delta = {{"content", chunk}};
+            if (first)
+            {
+                delta["role"] = "assistant";
+                first = false;
+            }
+            json event = {{"object", "chat.completion.chunk"},
+                          {"choices", {{{"index", 0}, {"delta", delta}, {"finish_reason", nullptr}}}}};
+            if (!send_headers() || !send_all(client_socket, "data: " + event.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n"))
+            {
+                cancel();
+            }
+        }
+
+        generation_result r = result.get();
+        admission_release(ticket, r);
+        if (r.finish_reason == "deadline" && !headers_sent)
+        {
+            return deadline_exceeded_response;
+        }
+        if (!cancelled && send_headers())
+        {
+            json event = {{"object", "chat.completion.chunk"},
+                          {"choices", {{{"index", 0}, {"delta", json::object()}, {"finish_reason", r.finish_reason}}}}};
+            if (r.finish_reason == "error")
+            {
+                // the message is the text that was not streamed, an engine failure mid-generation has none
+                std::string message = r.text.size() > n_streamed ? r.text.substr(n_streamed) : "Generation failed";
+                event["error"] = {{"message", message}};
+            }
+            send_all(client_socket, "data: " + event.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\ndata: [DONE]\n\n");
+        }
+        return "";
+    }
+
+    std::future<generation_result> pending = std::async(std::launch::async, [&]()
+                                                        { return generate_response(chat.images, chat.system_message, chat.user_texts, params); });
+    while (pending.wait_for(poll_interval) != std::future_status::ready)
+    {
+        if (!cancelled && peer_closed(client_socket))
+        {
+            cancel();
+        }
+    }
+    generation_result result = pending.get();
+    admission_release(ticket, result);
+    if (cancelled)
+    {
+        return "";
+    }
+    if (result.finish_reason == "deadline")
+    {
+        return deadline_exceeded_response;
+    }
+
+    std::cout << "Response content: " << result.text << std::endl;
+
+    json response = chat_completion(result);
+
+    // pieces of byte-fallback tokens are not always valid UTF-8 on their own
+    std::string response_body = response.dump(-1, ' ', false, json::error_handler_t::replace);
+    std::string http_response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n" + response_body;
+
+    return http_response;
+}
+
+// POST /v1/images/embeddings: the projected CLIP embeddings of a list of images, for retrieval
+// or clustering without a text model in the loop. All images of a request share one batched
+// encode on the vision lane and go through the same admission and fair sharing as completions.
+//   {"input": ["data:image/...;base64,...", ...], "pooling": "mean" | "none", "encoding_format": "base64" | "binary"}
+// base64 gives little-endian f16 per image in the JSON, binary an application/octet-stream of
+// int32 n_pos, int32 n_embd and the f16 values for each image in order.
+std::string process_embeddings_request(const std::string &request_headers, const std::string &request_body, int client_socket)
+{
+    trace_span parse_span("parse", trace_request, -1, "bytes", (int64_t)request_body.size());
+    json request;
+    try
+    {
+        request = json::parse(request_body);
+    }
+    catch (json::parse_error &e)
+    {
+        return bad_request_response("Invalid JSON: " + std::string(e.what()));
+    }
+    if (!request.is_object())
+    {
+        return bad_request_response("Invalid request, expected a JSON object");
+    }
+
+    json input = request.contains("input") ? request["input"] : json();
+    if (input.is_string())
+    {
+        input = json::array({input});
+    }
+    if (!input.is_array() || input.empty())
+    {
+        return bad_request_response("Missing or invalid 'input' field");
+    }
+    std::vector<image_input> images(input.size());
+    for (size_t i = 0; i < input.size(); i++)
+    {
+        if (!input[i].is_string() || !image_url_bytes(input[i], images[i].bytes))
+        {
+            return bad_request_response("Unsupported image URL, expected a base64 data:image URL");
+        }
+    }
+
+    // json::value throws on a non-string, which would take the server down from this thread
+    for (const char *field : {"pooling", "encoding_format"})
+    {
+        if (request.contains(field) && !request[field].is_string())
+        {
+            return bad_request_response("Invalid '" + std::string(field) + "', expected a string");
+        }
+    }
+    std::string pooling = request.value("pooling", std::string("mean"));
+    std::string encoding = request.value("encoding_format", std::string("base64"));
+    if (pooling != "mean" && pooling != "none")
+    {
+        return bad_request_response("Unsupported 'pooling': " + pooling);
+    }
+    if (encoding != "base64" && encoding != "binary")
+    {
+        return bad_request_response("Unsupported 'encoding_format': " + encoding);
+    }
+    parse_span.end();
+
+    generation_params params;
+    params.request_id = trace_request;
+    priority_class priority;
+    std::string api_key;
+    std::string scheduling_error = read_scheduling(request, request_headers, params, priority, api_key);
+    if (!scheduling_error.empty())
+    {
+        return scheduling_error;
+    }
+
+    admission_ticket ticket = admission_request(priority, params.deadline_ms, images.size(), 0, 0);
+    if (!ticket.admitted)
+    {
+        return admission_rejected_response(ticket);
+    }
+    params.est_vision_ms = ticket.vision_ms;
+    params.order = fair_share_order(api_key, priority, params.deadline_ms, ticket.vision_ms);
+
+    std::atomic<bool> cancelled{false};
+    params.cancel = &cancelled;
+
+    generation_result result;
+    image_embeddings embeddings;
+    std::vector<struct clip_image_u8 *> clip_images;
+    size_t failed = decode_images(images, clip_images);
+    bool ok = false;
+    if (!failed)
+    {
+        std::future<bool> pending = std::async(std::launch::async, [&]()
+                                               { return encode_images(clip_images, params, embeddings); });
+        while (pending.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready)
+        {
+            if (!cancelled && peer_closed(client_socket))
+            {
+                cancelled = true;
+                metrics.requests_cancelled_total++;
+            }
+        }
+        ok = pending.get();
+        free_images(clip_images);
+    }
+    result.finish_reason = cancelled ? "cancelled" : embeddings.missed_deadline ? "deadline"
+                                                 : ok                           ? "stop"
+                                                                                : "error";
+    result.vision_ms = embeddings.vision_ms;
+    result.image_tokens = embeddings.n_pos;
+    result.images_encoded = embeddings.embd.size();
+    admission_release(ticket, result);
+
+    if (cancelled)
+    {
+        return "";
+    }
+    if (failed)
+    {
+        return bad_request_response("Failed to decode image " + std::to_string(failed));
+    }
+    if (embeddings.missed_deadline)
+    {
+        return deadline_exceeded_response;
+    }
+    if (!ok)
+    {
+        return "HTTP/1.1 500 Internal Server Error\r\nContent-Type: application/json\r\n\r\n{\"error\": \"Failed to generate image embedding\"}";
+    }
+    metrics.embedded_images_total += images.size();
+
+    const int n_embd = clip_n_mmproj_embd(clip_ctx);
+    const std::string fingerprint = mmproj_fingerprint();
+
+    // f16 halves the payload; the projector output is well within its range
+    std::vector<ggml_fp16_t> half;
+    std::string binary;
+    json data = json::array();
+    int n_image_tokens = 0;
+    for (size_t i = 0; i < embeddings.embd.size(); i++)
+    {
+        n_image_tokens += embeddings.n_pos[i];
+        llava_image_embed embed = {embeddings.embd[i], embeddings.n_pos[i]};
+        if (pooling == "mean")
+        {
+            llava_image_embed_pool_mean(&embed, n_embd);
+        }
+        const size_t n_values = (size_t)embed.n_image_pos * n_embd;
+        half.resize(n_values);
+        ggml_fp32_to_fp16_row(embed.embed, half.data(), n_values);
+
+        if (encoding == "binary")
+        {
+            int32_t shape[2] = {embed.n_image_pos, n_embd};
+            binary.append((const char *)shape, sizeof(shape));
+            binary.append((const char *)half.data(), n_values * sizeof(ggml_fp16_t));
+        }
+        else
+        {
+            data.push_back({{"object", "image_embedding"},
+                            {"index", i},
+                            {"n_pos", embed.n_image_pos},
+                            {"n_embd", n_embd},
+                            {"embedding", base64_encode(half.data(), n_values * sizeof(ggml_fp16_t))}});
+        }
+    }
+
+    if (encoding == "binary")
+    {
+        return "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nX-Mmproj-Fingerprint: " + fingerprint +
+               "\r\nContent-Length: " + std::to_string(binary.size()) + "\r\n\r\n" + binary;
+    }
+    json response = {
+        {"object", "list"},
+        {"mmproj_fingerprint", fingerprint},
+        {"data", data},
+        {"usage", {{"images", images.size()}, {"image_tokens", n_image_tokens}}}};
+    std::string response_body = response.dump();
+    return "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(response_body.size()) + "\r\n\r\n" + response_body;
+}
+
+static double ms_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#ifdef LLAVA_BATCH
+// Output lines of a previous run: the ids it answered are skipped, a last line cut short by
+// the interruption is dropped. Failed requests are run again, so their error lines are
+// dropped too and every id keeps one line. The kept lines are rewritten through a temporary
+// file, an interrupted resume leaves the old output in place.
+static bool batch_resume(const std::string &output_path, std::set<std::string> &done)
+{
+    std::ifstream in(output_path, std::ios::binary);
+    if (!in)
+    {
+        return true;
+    }
+    const std::string tmp_path = output_path + ".tmp";
+    std::ofstream kept(tmp_path, std::ios::trunc | std::ios::binary);
+    std::string line;
+    while (std::getline(in, line) && !in.eof())
+    {
+        json result = json::parse(line, nullptr, false);
+        if (result.is_object() && result.contains("id") && result.contains("response"))
+        {
+            done.insert(result["id"].dump());
+            kept << line << '\n';
+        }
+    }
+    in.close();
+    kept.close();
+    if (!kept || std::rename(tmp_path.c_str(), output_path.c_str()) != 0)
+    {
+        std::cerr << "Failed to rewrite " << output_path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// llava-batch: runs a JSONL file of chat completion requests through the lanes and the batch
+// engine like the server does, without HTTP or admission control. Each line is a request, or
+// an OpenAI batch line {"custom_id", "body": request}; its id is custom_id, id or the line
+// number. Lines are read as requests finish, max_inflight at a time, so CLIP encodes ahead
+// while the text lane keeps every sequence busy. Each result is appended to the output as
+// {"id", "response": chat.completion} or {"id", "error"} in completion order and flushed,
+// and a rerun with the same output skips what is already there.
+int run_batch(const std::string &input_path, const std::string &output_path, int max_inflight)
+{
+    std::ifstream in(input_path);
+    if (!in)
+    {
+        std::cerr << "Failed to open " << input_path << std::endl;
+        return 1;
+    }
+    std::set<std::string> done;
+    if (!batch_resume(output_path, done))
+    {
+        return 1;
+    }
+    std::ofstream out(output_path, std::ios::app | std::ios::binary);
+    if (!out)
+    {
+        std::cerr << "Failed to open " << output_path << std::endl;
+        return 1;
+    }
+    if (!done.empty())
+    {
+        std::cout << "Resuming: " << done.size() << " requests already in " << output_path << std::endl;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int n_inflight = 0;
+    size_t n_finished = 0, n_failed = 0, n_skipped = 0;
+    long long n_generated = 0;
+    const auto t_start = std::chrono::steady_clock::now();
+    trace_local.name = "batch-reader";
+
+    // under mutex
+    auto write = [&](const json &result)
+    {
+        out << result.dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+        out.flush();
+        n_finished++;
+        n_failed += result.contains("error");
+        if (n_finished % 100 == 0)
+        {
+            const double s = ms_since(t_start) / 1000;
+            std::cerr << "llava-batch: " << n_finished << " done (" << n_failed << " failed), " << n_finished / s
+                      << " requests/s, " << n_generated / s << " tokens/s" << std::endl;
+        }
+    };
+
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(in, line))
+    {
+        line_number++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            continue;
+        }
+        json entry = json::parse(line, nullptr, false);
+        json id = line_number;
+        if (entry.is_object() && entry.contains("custom_id"))
+        {
+            id = entry["custom_id"];
+        }
+        else if (entry.is_object() && entry.contains("id"))
+        {
+            id = entry["id"];
+        }
+        if (done.count(id.dump()))
+        {
+            n_skipped++;
+            continue;
+        }
+
+        auto chat = std::make_shared<chat_request>();
+        trace_request = next_request_id++;
+        std::string error = entry.is_object() ? "" : "Invalid JSON on line " + std::to_string(line_number);
+        if (error.empty())
+        {
+            trace_span span("parse", trace_request, -1, "bytes", (int64_t)line.size());
+            error = parse_chat_request(entry.contains("body") ? entry["body"] : entry, *chat, true);
+        }
+        chat->params.request_id = trace_request;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!error.empty())
+        {
+            write({{"id", id}, {"error", error}});
+            continue;
+        }
+        cv.wait(lock, [&]()
+                { return n_inflight < max_inflight; });
+        n_inflight++;
+        lock.unlock();
+
+        std::thread([&, chat, id]()
+                    {
+            trace_request = chat->params.request_id;
+            generation_result result = generate_response(chat->images, chat->system_message, chat->user_texts, chat->params);
+            std::lock_guard<std::mutex> lock(mutex);
+            n_generated += result.n_generated;
+            if (result.finish_reason == "error")
+            {
+                write({{"id", id}, {"error", result.text}});
+            }
+            else
+            {
+                write({{"id", id}, {"response", chat_completion(result)}});
+            }
+            n_inflight--;
+            cv.notify_all(); })
+            .detach();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]()
+            { return n_inflight == 0; });
+    std::cout << "llava-batch: " << n_finished << " requests in " << ms_since(t_start) / 1000 << " s, " << n_failed << " failed, "
+              << n_skipped << " already done" << std::endl;
+    return n_failed > 0 ? 2 : 0;
+}
+#endif
+
+// True once the peer closed or reset the connection. A client that gives up and closes
+// only sends a FIN, which looks the same as a half-close (shutdown(SHUT_WR) after the body)
+// to TCP. So the FIN counts unless --allow-half-close is set; then only a reset does, or a
+// failed write when streaming.
+bool peer_closed(int socket)
+{
+    pollfd pfd = {socket, (short)(allow_half_close ? 0 : POLLRDHUP), 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+static bool is_cancelled(const generation_params &params)
+{
+    return params.cancel && params.cancel->load(std::memory_order_relaxed);
+}
+
+// True when the request could not finish by its deadline even if its remaining work
+// started right now. Such requests are dropped before any CLIP or LLM work.
+static bool deadline_unachievable(const generation_params &params, double remaining_ms)
+{
+    if (params.deadline_ms > 0 && steady_ms() + remaining_ms > params.deadline_ms)
+    {
+        admission.rejected_deadline++;
+        return true;
+    }
+    return false;
+}
+
+// ggml abort callback, data is the request's cancel flag
+static bool abort_if_cancelled(void *data)
+{
+    return data && static_cast<const std::atomic<bool> *>(data)->load(std::memory_order_relaxed);
+}
+
+static generation_result generation_error(const std::string &message)
+{
+    generation_result result;
+    result.text = message;
+    result.finish_reason = "error";
+    return result;
+}
+
+static generation_result generation_cancelled()
+{
+    generation_result result;
+    result.finish_reason = "cancelled";
+    return result;
+}
+
+static generation_result generation_deadline()
+{
+    generation_result result;
+    result.finish_reason = "deadline";
+    return result;
+}
+
+// Image requests encode on the vision lane first, then everything goes to the batch engine on the text lane
+generation_result generate_response(const std::vector<image_input> &images, const std::string &system_message, const std::vector<std::string> &user_texts, const generation_params &params)
+{
+    // the server calls this from a fresh async thread, the request's spans (decode) need its id
+    trace_request = params.request_id;
+    if (!images.empty())
+    {
+        std::cout << "Processing image request (" << images.size() << " images)" << std::endl;
+        return generate_image_description(images, system_message, user_texts, params);
+    }
+
+    std::cout << "Processing text request" << std::endl;
+    return generate_text_response(system_message, user_texts[0], params);
+}
+
+bool send_all(int socket, const std::string &data)
+{
+    trace_span span("send", trace_request, -1, "bytes", (int64_t)data.size());
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        // MSG_NOSIGNAL: a client that went away must not SIGPIPE the whole server
+        ssize_t n = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+std::string base64_decode(const std::string &encoded_string)
+{
+    std::string decoded_string;
+    int in_len = encoded_string.size();
+    int i = 0;
+    int j = 0;
+    int in_ = 0;
+    unsigned char char_array_4[4], char_array_3[3];
+
+    static const std::string base64_chars =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz"
+        "0123456789+/";
+
+    while (in_len-- && (encoded_string[in_] != '=') && (isalnum(encoded_string[in_]) || (encoded_string[in_] == '+') || (encoded_string[in_] == '/')))
+    {
+        char_array_4[i++] = encoded_string[in_];
+        in_++;
+        if (i == 4)
+        {
+            for (i = 0; i < 4; i++)
+                char_array_4[i] = base64_chars.find(char_array_4[i]);
+
+            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+            for (i = 0; (i < 3); i++)
+                decoded_string += char_array_3[i];
+            i = 0;
+        }
+    }
+
+    if (i)
+    {
+        for (j = i; j < 4; j++)
+            char_array_4[j] = 0;
+
+        for (j = 0; j < 4; j++)
+            char_array_4[j] = base64_chars.find(char_array_4[j]);
+
+        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+        for (j = 0; (j < i - 1); j++)
+            decoded_string += char_array_3[j];
+    }
+
+    return decoded_string;
+}
+
+std::string base64_encode(const void *data, size_t size)
+{
+    static const char base64_chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz"
+        "0123456789+/";
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    std::string encoded_string;
+    encoded_string.reserve((size + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < size; i += 3)
+    {
+        uint32_t triple = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+        encoded_string += base64_chars[(triple >> 18) & 0x3f];
+        encoded_string += base64_chars[(triple >> 12) & 0x3f];
+        encoded_string += base64_chars[(triple >> 6) & 0x3f];
+        encoded_string += base64_chars[triple & 0x3f];
+    }
+    if (i < size)
+    {
+        uint32_t triple = bytes[i] << 16;
+        if (i + 1 < size)
+        {
+            triple |= bytes[i + 1] << 8;
+        }
+        encoded_string += base64_chars[(triple >> 18) & 0x3f];
+        encoded_string += base64_chars[(triple >> 12) & 0x3f];
+        encoded_string += i + 1 < size ? base64_chars[(triple >> 6) & 0x3f] : '=';
+        encoded_string += '=';
+    }
+    return encoded_string;
+}
+
+// Largest logit. This pass and the threshold gather below touch the whole vocabulary,
+// everything after them works on the few tokens that survive the cutoff.
+static float logits_max(const float *logits, int n)
+{
+    int i = 0;
+    float result = -INFINITY;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_set1_ps(-INFINITY);
+    for (; i + 16 <= n; i += 16)
+    {
+        acc = _mm512_max_ps(acc, _mm512_loadu_ps(logits + i));
+    }
+    result = _mm512_reduce_max_ps(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8)
+    {
+        acc = _mm256_max_ps(acc, _mm256_loadu_ps(logits + i));
+    }
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    result = _mm_cvtss_f32(m);
+#endif
+    for (; i < n; i++)
+    {
+        result = std::max(result, logits[i]);
+    }
+    return result;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+// Cephes-style expf for 8 lanes, arguments here are <= 0
+static inline __m256 exp_avx2(__m256 x)
+{
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.3f));
+    __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+#endif
+
+// out[i] = exp((logits[i] - max) * scale), 0 below cutoff. Returns the sum.
+static float softmax_exp(const float *logits, float *out, int n, float max, float scale, float cutoff)
+{
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(logits + i);
+        __m256 keep = _mm256_cmp_ps(x, _mm256_set1_ps(cutoff), _CMP_GE_OQ);
+        __m256 e = _mm256_and_ps(keep, exp_avx2(_mm256_mul_ps(_mm256_sub_ps(x, _mm256_set1_ps(max)), _mm256_set1_ps(scale))));
+        _mm256_storeu_ps(out + i, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    s4 = _mm_add_ss(s4, _mm_shuffle_ps(s4, s4, 1));
+    sum = _mm_cvtss_f32(s4);
+#endif
+    for (; i < n; i++)
+    {
+        out[i] = logits[i] >= cutoff ? std::exp((logits[i] - max) * scale) : 0.0f;
+        sum += out[i];
+    }
+    return sum;
+}
+
+static llama_token argmax_token(const float *logits, int n_vocab)
+{
+    const float max = logits_max(logits, n_vocab);
+    return (llama_token)(std::find(logits, logits + n_vocab, max) - logits);
+}
+
+// Sampler chain: sparse penalties -> greedy or temperature -> min-p / precision cutoff ->
+// top-k (streaming heap) -> softmax -> top-p (partial sort) -> draw. Without top-k the
+// softmax runs vectorized over the whole row and candidates are only built for top-p.
+struct token_sampler
+{
+    sampling_params params;
+    std::mt19937 rng;
+    std::deque<llama_token> window;             // last penalty_last_n tokens
+    std::unordered_map<llama_token, int> counts; // occurrences in window
+    std::vector<llama_token_data> cur;          // reused candidate buffer
+    std::vector<float> probs;                   // reused full-row softmax buffer
+
+    token_sampler(const sampling_params &params, const std::vector<llama_token> &prompt_tokens)
+        : params(params), rng(params.seed == 0xFFFFFFFF ? std::random_device{}() : params.seed)
+    {
+        size_t first = prompt_tokens.size() - std::min<size_t>(prompt_tokens.size(), std::max(0, params.penalty_last_n));
+        for (size_t i = first; i < prompt_tokens.size(); i++)
+        {
+            accept(prompt_tokens[i]);
+        }
+    }
+
+    void accept(llama_token id)
+    {
+        if (params.penalty_last_n <= 0)
+        {
+            return;
+        }
+        window.push_back(id);
+        counts[id]++;
+        if ((int)window.size() > params.penalty_last_n)
+        {
+            if (--counts[window.front()] == 0)
+            {
+                counts.erase(window.front());
+            }
+            window.pop_front();
+        }
+    }
+
+    // logits is the row llama_get_logits_ith returned, penalties are applied in place
+    llama_token sample(float *logits, int n_vocab)
+    {
+        const auto t_start = std::chrono::steady_clock::now();
+
+        // penalties only touch the tokens in the window
+        const bool penalize = params.repeat_penalty != 1.0f || params.presence_penalty != 0.0f || params.frequency_penalty != 0.0f;
+        if (penalize)
+        {
+            for (const auto &entry : counts)
+            {
+                float &logit = logits[entry.first];
+                logit = logit > 0 ? logit / params.repeat_penalty : logit * params.repeat_penalty;
+                logit -= entry.second * params.frequency_penalty + params.presence_penalty;
+            }
+        }
+
+        llama_token id;
+        if (params.temperature <= 0.0f || params.top_k == 1)
+        {
+            id = argmax_token(logits, n_vocab);
+        }
+        else
+        {
+            id = sample_tempered(logits, n_vocab);
+        }
+
+        metrics.sampled_tokens_total++;
+        metrics.sampling_ns_total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t_start).count();
+        return id;
+    }
+
+private:
+    llama_token sample_tempered(const float *logits, int n_vocab)
+    {
+        const float max = logits_max(logits, n_vocab);
+        const float scale = 1.0f / params.temperature;
+
+        // Tokens below e^-20 of the best one hold at most n_vocab * 2e-9 of the mass together
+        // and are dropped up front; min-p raises the cutoff further
+        float cutoff = max - 20.0f * params.temperature;
+        if (params.min_p > 0.0f)
+        {
+            cutoff = std::max(cutoff, max + params.temperature * std::log(params.min_p));
+        }
+
+        auto by_logit = [](const llama_token_data &a, const llama_token_data &b)
+        { return a.logit > b.logit; };
+
+        float sum = 0.0f;
+        cur.clear();
+        if (params.top_k > 0)
+        {
+            // top-k as a streaming min-heap, most tokens fail the comparison with its root
+            for (int i = 0; i < n_vocab; i++)
+            {
+                if (logits[i] < cutoff)
+                {
+                    continue;
+                }
+                if ((int)cur.size() < params.top_k)
+                {
+                    cur.push_back({i, logits[i], 0.0f});
+                    std::push_heap(cur.begin(), cur.end(), by_logit);
+                }
+                else if (logits[i] > cur.front().logit)
+                {
+                    std::pop_heap(cur.begin(), cur.end(), by_logit);
+                    cur.back() = {i, logits[i], 0.0f};
+                    std::push_heap(cur.begin(), cur.end(), by_logit);
+                }
+            }
+            for (llama_token_data &c : cur)
+            {
+                c.p = std::exp((c.logit - max) * scale);
+                sum += c.p;
+            }
+        }
+        else
+        {
+            probs.resize(n_vocab);
+            sum = softmax_exp(logits, probs.data(), n_vocab, max, scale, cutoff);
+            if (params.top_p >= 1.0f)
+            {
+                return draw(probs.data(), n_vocab, sum);
+            }
+
+            // The nucleus is usually a handful of tokens: gather the ones within a factor of the
+            // best token (p = 1) and widen the factor until they hold top_p of the mass
+            float threshold = 1e-3f;
+            while (true)
+            {
+                cur.clear();
+                float mass = 0.0f;
+                for (int i = 0; i < n_vocab; i++)
+                {
+                    if (probs[i] > 0.0f && probs[i] >= threshold)
+                    {
+                        cur.push_back({i, logits[i], probs[i]});
+                        mass += probs[i];
+                    }
+                }
+                if (mass >= params.top_p * sum || threshold == 0.0f)
+                {
+                    break;
+                }
+                threshold = threshold < 1e-9f ? 0.0f : threshold * 1e-3f;
+            }
+        }
+
+        if (params.top_p < 1.0f)
+        {
+            std::sort(cur.begin(), cur.end(), by_logit);
+            const float target = params.top_p * sum;
+            float cum = 0.0f;
+            size_t keep = 0;
+            while (keep < cur.size() && cum < target)
+            {
+                cum += cur[keep++].p;
+            }
+            cur.resize(std::max<size_t>(1, keep));
+            sum = cum > 0.0f ? cum : cur[0].p;
+        }
+
+        float r = std::uniform_real_distribution<float>(0.0f, sum)(rng);
+        for (const llama_token_data &c : cur)
+        {
+            r -= c.p;
+            if (r <= 0.0f)
+            {
+                return c.id;
+            }
+        }
+        return cur.back().id;
+    }
+
+    llama_token draw(const float *p, int n, float sum)
+    {
+        float r = std::uniform_real_distribution<float>(0.0f, sum)(rng);
+        int last = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (p[i] > 0.0f)
+            {
+                last = i;
+                r -= p[i];
+                if (r <= 0.0f)
+                {
+                    return i;
+                }
+            }
+        }
+        return last;
+    }
+};
+
+// Evaluate the prompt in the draft context. The draft has no image input, it only sees the
+// text tokens that follow the image in the main context.
+static bool draft_begin(const std::vector<llama_token> &prompt_tokens)
+{
+    llama_kv_cache_clear(draft.ctx);
+    draft.n_past = 0;
+    draft.n_synced = 0;
+
+    const int n_batch = llama_n_batch(draft.ctx);
+    for (size_t i = 0; i < prompt_tokens.size(); i += n_batch)
+    {
+        int n_eval = std::min<int>(n_batch, prompt_tokens.size() - i);
+        if (llama_decode(draft.ctx, llama_batch_get_one(const_cast<llama_token *>(&prompt_tokens[i]), n_eval, draft.n_past, 0)))
+        {
+            return false;
+        }
+        draft.n_past += n_eval;
+    }
+    return true;
+}
+
+// Greedily propose up to n_max tokens following the generated ones
+static std::vector<llama_token> draft_propose(const std::vector<llama_token> &generated, int n_max)
+{
+    std::vector<llama_token> proposal;
+    if (n_max <= 0)
+    {
+        return proposal;
+    }
+
+    // drop the previous proposal and catch up on the tokens generated since
+    llama_kv_cache_seq_rm(draft.ctx, 0, draft.n_past, -1);
+    llama_batch_clear(draft.batch);
+    for (size_t i = draft.n_synced; i < generated.size(); i++)
+    {
+        llama_batch_add(draft.batch, generated[i], draft.n_past++, {0}, i + 1 == generated.size());
+    }
+    draft.n_synced = generated.size();
+    if (llama_decode(draft.ctx, draft.batch))
+    {
+        return proposal;
+    }
+
+    const int n_vocab = llama_n_vocab(draft.model);
+    for (int i = 0; i < n_max; i++)
+    {
+        llama_token id = argmax_token(llama_get_logits_ith(draft.ctx, -1), n_vocab);
+        proposal.push_back(id);
+        if (i + 1 == n_max || llama_token_is_eog(draft.model, id))
+        {
+            break;
+        }
+
+        llama_batch_clear(draft.batch);
+        llama_batch_add(draft.batch, id, draft.n_past + i, {0}, true);
+        if (llama_decode(draft.ctx, draft.batch))
+        {
+            break;
+        }
+    }
+    return proposal;
+}
+
+// Aho-Corasick automaton over the stop sequences, compiled into a byte-level DFA. Every
+// generated piece is fed through it, so a stop sequence that spans several tokens is found on
+// the token that completes it, without rescanning the output.
+struct stop_matcher
+{
+    std::vector<std::array<int, 256>> next; // transitions
+    std::vector<int> match_len;             // longest stop sequence ending in a state, 0: none
+    std::vector<int> depth;                 // bytes of the stop sequence prefix a state stands for
+    int state = 0;
+    size_t n_fed = 0;
+
+    explicit stop_matcher(const std::vector<std::string> &stops)
+    {
+        add_state();
+        for (const std::string &stop : stops)
+        {
+            int node = 0;
+            for (unsigned char c : stop)
+            {
+                if (next[node][c] < 0)
+                {
+                    int child = add_state();
+                    depth[child] = depth[node] + 1;
+                    next[node][c] = child;
+                }
+                node = next[node][c];
+            }
+            match_len[node] = std::max<int>(match_len[node], stop.size());
+        }
+
+        // breadth-first over the trie, filling missing transitions from the failure links
+        std::vector<int> fail(next.size(), 0);
+        std::queue<int> queue;
+        for (int c = 0; c < 256; c++)
+        {
+            if (next[0][c] < 0)
+            {
+                next[0][c] = 0;
+            }
+            else
+            {
+                queue.push(next[0][c]);
+            }
+        }
+        while (!queue.empty())
+        {
+            int node = queue.front();
+            queue.pop();
+            match_len[node] = std::max(match_len[node], match_len[fail[node]]);
+            for (int c = 0; c < 256; c++)
+            {
+                int child = next[node][c];
+                if (child < 0)
+                {
+                    next[node][c] = next[fail[node]][c];
+                }
+                else
+                {
+                    fail[child] = next[fail[node]][c];
+                    queue.push(child);
+                }
+            }
+        }
+    }
+
+    // Returns the stream offset where a completed stop sequence starts, -1 if none did
+    long feed(const char *data, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            state = next[state][(unsigned char)data[i]];
+            n_fed++;
+            if (match_len[state] > 0)
+            {
+                return (long)(n_fed - match_len[state]);
+            }
+        }
+        return -1;
+    }
+
+    // Trailing bytes of the stream that may still become a stop sequence, held back from
+    // streaming until the next token decides
+    size_t partial() const
+    {
+        return depth[state];
+    }
+
+private:
+    int add_state()
+    {
+        next.emplace_back();
+        next.back().fill(-1);
+        match_len.push_back(0);
+        depth.push_back(0);
+        return next.size() - 1;
+    }
+};
+
+// Prompt lookup: find the most recent earlier occurrence of the last n tokens of history
+// (prompt + generated), trying n = ngram_size down to 1, and propose what followed it
+static std::vector<llama_token> lookup_propose(const std::vector<llama_token> &history, int ngram_size, int n_max)
+{
+    std::vector<llama_token> proposal;
+    const int n_history = history.size();
+    for (int n = std::min(ngram_size, n_history - 1); n >= 1 && n_max > 0; n--)
+    {
+        const llama_token *ngram = &history[n_history - n];
+        for (int start = n_history - n - 1; start >= 0; start--)
+        {
+            if (!std::equal(ngram, ngram + n, &history[start]))
+            {
+                continue;
+            }
+            const int end = std::min(n_history, start + n + n_max);
+            proposal.assign(history.begin() + start + n, history.begin() + end);
+            return proposal;
+        }
+    }
+    return proposal;
+}
+
+// A request on the batch engine. It lives on the stack of generate_sequence, which waits for
+// `done`; the engine does not touch it anymore once the promise is fulfilled.
+struct text_slot
+{
+    text_slot(std::vector<prompt_segment> segments, const generation_params &params, size_t n_ready);
+
+    const generation_params &params;
+    std::vector<prompt_segment> prompt;
+    std::atomic<size_t> n_ready;         // leading segments available for prefill, see engine_provide
+    std::atomic<bool> abandoned{false}; // the missing input will not come, the caller reports why
+    std::vector<llama_token> prompt_tokens; // text part of the prompt, for the penalties and the draft
+    int seq = -1;
+    size_t segment = 0; // prefill cursor: segment and position within it
+    int offset = 0;
+    int n_past = 0;
+    bool decoding = false;
+
+    speculative_mode mode = SPEC_NONE;
+    int n_draft = 0;
+    token_sampler sampler;
+    stop_matcher stop;
+    utf8_assembler utf8;
+    size_t n_streamed = 0;
+    std::vector<llama_token> generated;
+    std::vector<llama_token> history; // prompt + generated, for SPEC_NGRAM
+    llama_token cur = 0;              // sampled, not yet decoded
+    std::vector<llama_token> proposal;
+
+    // set while building a step
+    enum
+    {
+        OUTPUT_NONE,
+        OUTPUT_DECODE,         // cur + proposal, rows from i_batch on in batch
+        OUTPUT_PREFILL,        // last prompt position in batch
+        OUTPUT_PREFILL_EMBD,   // last prompt position in embd_batch
+    } output = OUTPUT_NONE;
+    int i_batch = -1;
+    bool in_batch = false;
+    bool in_embd_batch = false;
+    int n_step_tokens = 0; // rows in batch, embd_batch, for the trace
+    int n_step_embd = 0;
+    std::string finished; // finish reason once done, the slot is retired after the step
+
+    std::chrono::steady_clock::time_point t_start, t_decode, t_output;
+    generation_result result;
+    std::promise<generation_result> done;
+};
+
+static std::vector<llama_token> text_tokens(const std::vector<prompt_segment> &prompt)
+{
+    std::vector<llama_token> tokens;
+    for (const prompt_segment &segment : prompt)
+    {
+        tokens.insert(tokens.end(), segment.tokens.begin(), segment.tokens.end());
+    }
+    return tokens;
+}
+
+static int prompt_positions(const std::vector<prompt_segment> &prompt)
+{
+    int n = 0;
+    for (const prompt_segment &segment : prompt)
+    {
+        n += segment.size();
+    }
+    return n;
+}
+
+text_slot::text_slot(std::vector<prompt_segment> segments, const generation_params &params, size_t n_ready)
+    : params(params), prompt(std::move(segments)), n_ready(n_ready), prompt_tokens(text_tokens(prompt)),
+      sampler(params.sampling, prompt_tokens), stop(params.stop), history(prompt_tokens)
+{
+}
+
+// Hands the output up to `end` to the streaming callback
+static void slot_stream_until(text_slot &slot, size_t end)
+{
+    if (!slot.params.on_text || end <= slot.n_streamed)
+    {
+        return;
+    }
+    std::string chunk = slot.utf8.push(slot.result.text.data() + slot.n_streamed, end - slot.n_streamed);
+    slot.n_streamed = end;
+    if (!chunk.empty())
+    {
+        slot.params.on_text(chunk);
+    }
+}
+
+// Appends an accepted token to the output. Returns false once it completed a stop sequence,
+// the output is then cut where the stop sequence starts.
+static bool slot_emit(text_slot &slot, llama_token id)
+{
+    std::string &text = slot.result.text;
+    slot.generated.push_back(id);
+    slot.history.push_back(id);
+    slot.sampler.accept(id);
+    text.append(pieces.data(id), pieces.size(id));
+    long stop_at = slot.params.stop.empty() ? -1 : slot.stop.feed(pieces.data(id), pieces.size(id));
+    if (stop_at >= 0)
+    {
+        text.resize(stop_at);
+        return false;
+    }
+    slot_stream_until(slot, text.size() - slot.stop.partial());
+    return true;
+}
+
+// Looks at the freshly sampled cur: ends the sequence or emits it, it is decoded next step
+static void slot_advance(text_slot &slot)
+{
+    if (llama_token_is_eog(llama_model, slot.cur))
+    {
+        slot.finished = "stop";
+    }
+    else if ((int)slot.generated.size() >= slot.params.n_predict || slot.n_past >= engine.n_ctx_slot)
+    {
+        slot.finished = "length";
+    }
+    else if (!slot_emit(slot, slot.cur))
+    {
+        slot.finished = "stop";
+    }
+}
+
+// The prompt is in the KV cache and logits holds its last position
+static void slot_begin_decode(text_slot &slot, float *logits)
+{
+    slot.decoding = true;
+    slot.result.n_prompt = slot.n_past;
+    slot.result.prefill_ms = ms_since(slot.t_start);
+    slot.t_decode = slot.t_output = std::chrono::steady_clock::now();
+
+    // the draft context holds a single sequence, concurrent requests decode without it
+    slot.mode = slot.params.speculative;
+    if (slot.mode == SPEC_DRAFT)
+    {
+        if (draft.ctx != nullptr && draft.owner == nullptr && draft_begin(slot.prompt_tokens))
+        {
+            draft.owner = &slot;
+        }
+        else
+        {
+            slot.mode = SPEC_NONE;
+        }
+    }
+    slot.n_draft = slot.mode == SPEC_DRAFT ? draft.n_draft : slot.mode == SPEC_NGRAM ? slot.params.n_draft : 0;
+
+    slot.cur = slot.sampler.sample(logits, llama_n_vocab(llama_model));
+    slot_advance(slot);
+}
+
+// After a decode step: keeps the longest prefix of the proposal the main model agrees with.
+// The main model samples each position itself and a proposed token only counts if it equals
+// that sample, so speculation changes how many tokens one decode yields, never which tokens
+// are produced.
+static void slot_verify(text_slot &slot)
+{
+    const int n_vocab = llama_n_vocab(llama_model);
+    slot.n_past++;
+
+    bool stopped = false;
+    size_t n_accepted = 0;
+    slot.cur = slot.sampler.sample(llama_get_logits_ith(llama_ctx, slot.i_batch), n_vocab);
+    while (n_accepted < slot.proposal.size() && slot.cur == slot.proposal[n_accepted] && !llama_token_is_eog(llama_model, slot.cur))
+    {
+        slot.n_past++;
+        n_accepted++;
+        if (!slot_emit(slot, slot.cur))
+        {
+            stopped = true;
+            break;
+        }
+        slot.cur = slot.sampler.sample(llama_get_logits_ith(llama_ctx, slot.i_batch + n_accepted), n_vocab);
+    }
+
+    if (!slot.proposal.empty())
+    {
+        // cells of the rejected tail
+        llama_kv_cache_seq_rm(llama_ctx, slot.seq, slot.n_past, -1);
+        metrics.spec_drafted_total[slot.mode] += slot.proposal.size();
+        metrics.spec_accepted_total[slot.mode] += n_accepted;
+    }
+
+    metrics.observe_time_between_tokens(ms_since(slot.t_output) / 1000);
+    slot.t_output = std::chrono::steady_clock::now();
+
+    if (stopped)
+    {
+        slot.finished = "stop";
+    }
+    else
+    {
+        slot_advance(slot);
+    }
+}
+
+// Ends the request: flushes the output, gives the sequence and its KV cells back and wakes
+// the waiting thread
+static void slot_retire(text_slot *slot)
+{
+    generation_result &result = slot->result;
+    if (slot->finished != "cancelled")
+    {
+        // a trailing incomplete UTF-8 sequence can not be completed anymore
+        slot_stream_until(*slot, result.text.size());
+        if (!slot->params.on_text)
+        {
+            slot->utf8.push(result.text.data(), result.text.size());
+        }
+        result.text.resize(result.text.size() - slot->utf8.pending.size());
+    }
+    if (!slot->decoding)
+    {
+        result.n_prompt = slot->n_past;
+    }
+    result.n_generated = slot->generated.size();
+    result.finish_reason = slot->finished;
+    if (slot->decoding)
     {
-        request = json::parse(request_body);
+        result.decode_ms = ms_since(slot->t_decode);
     }
-    catch (json::parse_error &e)
+
+    llama_kv_cache_seq_rm(llama_ctx, slot->seq, -1, -1);
+    if (draft.owner == slot)
     {
-        std::string error_msg = "Invalid JSON: " + std::string(e.what()) + ". Request body: " + request_body;
-        return "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\n\r\n{\"error\": \"" + error_msg + "\"}";
+        llama_kv_cache_seq_rm(draft.ctx, 0, -1, -1);
+        draft.owner = nullptr;
     }
+    engine.free_seqs.push_back(slot->seq);
+    engine.active.erase(std::find(engine.active.begin(), engine.active.end(), slot));
+    slot->done.set_value(result);
+}
 
-    if (!request.contains("messages") || !request["messages"].is_array())
+// One llama_decode of the step: a span on the engine thread and one on the track of each
+// sequence with rows in it
+static void trace_step_decode(const char *name, int64_t ts_us, int n_tokens, bool embd)
+{
+    const int64_t dur_us = trace_now_us() - ts_us;
+    trace_record(name, ts_us, dur_us, 0, -1, "tokens", n_tokens);
+    for (text_slot *slot : engine.active)
     {
-        return "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\n\r\n{\"error\": \"Missing or invalid 'messages' field\"}";
+        const int n = embd ? slot->n_step_embd : slot->n_step_tokens;
+        if (n > 0)
+        {
+            const bool decode = !embd && slot->output == text_slot::OUTPUT_DECODE;
+            trace_record(decode ? "decode-step" : "prefill-chunk", ts_us, dur_us, slot->params.request_id, slot->seq, "tokens", n, slot->seq);
+        }
     }
+}
 
-    std::string system_message;
-    std::string user_message;
-    std::string image_data;
+// One scheduler step. Every generating sequence gets its decode position (plus speculative
+// ones), prompt chunks of the sequences in prefill fill the rest of the token budget.
+// Embedding rows can not share a llama_batch with token rows, they go into embd_batch, which
+// is decoded second; a sequence stops adding prompt for this step after an embedding chunk so
+// its positions are still decoded in order.
+static bool engine_step()
+{
+    llama_batch &batch = engine.batch;
+    llama_batch &embd_batch = engine.embd_batch;
+    const int n_embd = llama_n_embd(llama_model);
+    llama_batch_clear(batch);
+    embd_batch.n_tokens = 0;
 
-    for (const auto &message : request["messages"])
+    for (text_slot *slot : engine.active)
     {
-        if (!message.is_object() || !message.contains("role") || !message.contains("content"))
+        slot->output = text_slot::OUTPUT_NONE;
+        slot->in_batch = slot->in_embd_batch = false;
+        slot->n_step_tokens = slot->n_step_embd = 0;
+        if (is_cancelled(slot->params))
+        {
+            slot->finished = "cancelled";
+        }
+        else if (slot->abandoned)
+        {
+            slot->finished = "error";
+        }
+        if (!slot->decoding || !slot->finished.empty())
         {
             continue;
         }
 
-        std::string role = message["role"];
+        const int n_max = std::min({slot->n_draft, slot->params.n_predict - (int)slot->generated.size(), engine.n_ctx_slot - slot->n_past - 1});
+        slot->proposal.clear();
+        if (slot->mode == SPEC_DRAFT)
+        {
+            slot->proposal = draft_propose(slot->generated, n_max);
+        }
+        else if (slot->mode == SPEC_NGRAM)
+        {
+            slot->proposal = lookup_propose(slot->history, slot->params.ngram_size, n_max);
+        }
 
-        if (role == "system" && message["content"].is_string())
+        slot->output = text_slot::OUTPUT_DECODE;
+        slot->in_batch = true;
+        slot->i_batch = batch.n_tokens;
+        llama_batch_add(batch, slot->cur, slot->n_past, {slot->seq}, true);
+        for (size_t i = 0; i < slot->proposal.size(); i++)
         {
-            system_message = message["content"];
+            llama_batch_add(batch, slot->proposal[i], slot->n_past + 1 + i, {slot->seq}, true);
         }
-        else if (role == "user")
+        slot->n_step_tokens = 1 + slot->proposal.size();
+    }
+    metrics.batch_decode_tokens_total += batch.n_tokens;
+    const int n_decode_rows = batch.n_tokens;
+
+    int n_left = engine.n_budget - batch.n_tokens;
+    for (text_slot *slot : engine.active)
+    {
+        if (slot->decoding || !slot->finished.empty())
         {
-            if (message["content"].is_string())
+            continue;
+        }
+        // segments that are not ready yet (an image still in CLIP) hold the sequence here
+        while (n_left > 0 && slot->segment < slot->n_ready.load(std::memory_order_acquire))
+        {
+            const prompt_segment &segment = slot->prompt[slot->segment];
+            const int n = std::min(n_left, segment.size() - slot->offset);
+            if (slot->n_past + segment.size() - slot->offset >= engine.n_ctx_slot)
             {
-                user_message = message["content"];
+                slot->result.text = "Error: Prompt does not fit the context";
+                slot->finished = "error";
+                break;
             }
-            else if (message["content"].is_array())
+            const bool last = slot->segment + 1 == slot->prompt.size() && slot->offset + n == segment.size();
+            if (segment.embd)
             {
-                for (const auto &content : message["content"])
+                for (int i = 0; i < n; i++)
                 {
-                    if (content.contains("type") && content["type"] == "text")
-                    {
-                        user_message = content["text"];
-                    }
-                    else if (content.contains("type") && content["type"] == "image_url")
-                    {
-                        std::string image_url = content["image_url"]["url"];
-                        if (image_url.substr(0, 22) == "data:image/png;base64,")
-                        {
-                            image_data = image_url.substr(22);
-                        }
-                    }
+                    const int row = embd_batch.n_tokens++;
+                    std::memcpy(embd_batch.embd + (size_t)row * n_embd, segment.embd + (size_t)(slot->offset + i) * n_embd, n_embd * sizeof(float));
+                    embd_batch.pos[row] = slot->n_past + i;
+                    embd_batch.n_seq_id[row] = 1;
+                    embd_batch.seq_id[row][0] = slot->seq;
+                    embd_batch.logits[row] = last && i == n - 1;
+                }
+                slot->in_embd_batch = true;
+                slot->n_step_embd += n;
+            }
+            else
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    llama_batch_add(batch, segment.tokens[slot->offset + i], slot->n_past + i, {slot->seq}, last && i == n - 1);
                 }
+                slot->in_batch = true;
+                slot->n_step_tokens += n;
+            }
+            if (last)
+            {
+                slot->output = segment.embd ? text_slot::OUTPUT_PREFILL_EMBD : text_slot::OUTPUT_PREFILL;
+                slot->i_batch = (segment.embd ? embd_batch.n_tokens : batch.n_tokens) - 1;
+            }
+
+            slot->n_past += n;
+            slot->offset += n;
+            n_left -= n;
+            metrics.batch_prefill_tokens_total += n;
+            if (slot->offset == segment.size())
+            {
+                slot->segment++;
+                slot->offset = 0;
+            }
+            if (segment.embd)
+            {
+                break;
             }
         }
     }
 
-    std::string response_content;
-    if (!image_data.empty())
+    if (batch.n_tokens > 0)
+    {
+        const int64_t ts_us = tracing.enabled ? trace_now_us() : 0;
+        const bool ok = llama_decode(llama_ctx, batch) == 0;
+        if (tracing.enabled)
+        {
+            trace_step_decode(n_decode_rows > 0 ? "decode-step" : "prefill-chunk", ts_us, batch.n_tokens, false);
+        }
+        for (text_slot *slot : engine.active)
+        {
+            if (!ok && slot->in_batch)
+            {
+                std::cerr << "Error: Failed to decode batch for sequence " << slot->seq << std::endl;
+                slot->finished = "error";
+            }
+            else if (ok && slot->output == text_slot::OUTPUT_DECODE)
+            {
+                slot_verify(*slot);
+            }
+            else if (ok && slot->output == text_slot::OUTPUT_PREFILL)
+            {
+                slot_begin_decode(*slot, llama_get_logits_ith(llama_ctx, slot->i_batch));
+            }
+        }
+    }
+    if (embd_batch.n_tokens > 0)
     {
-        std::cout << "Processing image request" << std::endl;
-        response_content = generate_image_description(image_data, system_message, user_message);
+        const int64_t ts_us = tracing.enabled ? trace_now_us() : 0;
+        const bool ok = llama_decode(llama_ctx, embd_batch) == 0;
+        if (tracing.enabled)
+        {
+            trace_step_decode("prefill-chunk", ts_us, embd_batch.n_tokens, true);
+        }
+        for (text_slot *slot : engine.active)
+        {
+            if (!ok && slot->in_embd_batch)
+            {
+                std::cerr << "Error: Failed to decode image embedding for sequence " << slot->seq << std::endl;
+                slot->finished = "error";
+            }
+            else if (ok && slot->output == text_slot::OUTPUT_PREFILL_EMBD && slot->finished.empty())
+            {
+                slot_begin_decode(*slot, llama_get_logits_ith(llama_ctx, slot->i_batch));
+            }
+        }
     }
-    else
+    const bool decoded = batch.n_tokens > 0 || embd_batch.n_tokens > 0;
+    if (decoded)
     {
-        std::cout << "Processing text request" << std::endl;
-        response_content = generate_text_response(system_message, user_message);
+        metrics.batch_steps_total++;
     }
 
-    std::cout << "Response content: " << response_content << std::endl;
-
-    json response = {
-        {"choices", {{{"message", {{"role", "assistant"}, {"content", response_content}}}}}}};
-
-    std::string response_body = response.dump();
-    std::string http_response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n" + response_body;
-
-    return http_response;
+    std::vector<text_slot *> finished;
+    for (text_slot *slot : engine.active)
+    {
+        if (!slot->finished.empty())
+        {
+            finished.push_back(slot);
+        }
+    }
+    for (text_slot *slot : finished)
+    {
+        slot_retire(slot);
+    }
+    return decoded || !finished.empty();
 }
 
-std::string base64_decode(const std::string &encoded_string)
+// Runs steps until no sequence is left. Requests queued on the text lane in the meantime are
+// admitted between steps, in the lane's job_order, while there are free sequences. When every
+// sequence waits for its image the lane sleeps until one arrives, a request is queued or the
+// poll interval for cancellations ends.
+static void engine_run()
 {
-    std::string decoded_string;
-    int in_len = encoded_string.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-
-    static const std::string base64_chars =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz"
-        "0123456789+/";
-
-    while (in_len-- && (encoded_string[in_] != '=') && (isalnum(encoded_string[in_]) || (encoded_string[in_] == '+') || (encoded_string[in_] == '/')))
+    engine.running = true;
+    while (!engine.active.empty())
     {
-        char_array_4[i++] = encoded_string[in_];
-        in_++;
-        if (i == 4)
+        std::function<void()> job;
+        while (!engine.free_seqs.empty() && lane_try_pop(text_lane, job))
         {
-            for (i = 0; i < 4; i++)
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; (i < 3); i++)
-                decoded_string += char_array_3[i];
-            i = 0;
+            job();
+        }
+        if (!engine_step())
+        {
+            std::unique_lock<std::mutex> lock(text_lane.mutex);
+            text_lane.cv.wait_for(lock, std::chrono::milliseconds(50), []()
+                                  { return engine.wake || (!text_lane.jobs.empty() && !engine.free_seqs.empty()); });
+            engine.wake = false;
         }
     }
+    engine.running = false;
+}
 
-    if (i)
+static void engine_wake()
+{
     {
-        for (j = i; j < 4; j++)
-            char_array_4[j] = 0;
+        std::lock_guard<std::mutex> lock(text_lane.mutex);
+        engine.wake = true;
+    }
+    text_lane.cv.notify_all();
+}
 
-        for (j = 0; j < 4; j++)
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
+// Hands a sequence the image embedding for its segment `segment`, it and the text up to the
+// next image can be prefilled from then on. Called from the request's thread, in prompt order.
+static void engine_provide(text_slot &slot, size_t segment, const float *embd, int n_pos)
+{
+    slot.prompt[segment].embd = embd;
+    slot.prompt[segment].n_pos = n_pos;
+    size_t n_ready = segment + 1;
+    while (n_ready < slot.prompt.size() && !slot.prompt[n_ready].tokens.empty())
+    {
+        n_ready++;
+    }
+    slot.n_ready.store(n_ready, std::memory_order_release);
+    engine_wake();
+}
 
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+// The sequence's missing input will not come: it is dropped at the next step
+static void engine_abandon(text_slot &slot)
+{
+    slot.abandoned = true;
+    engine_wake();
+}
 
-        for (j = 0; (j < i - 1); j++)
-            decoded_string += char_array_3[j];
+// Text lane job of a request: takes a free sequence and joins the running steps, or starts them
+static void engine_admit(text_slot &slot)
+{
+    if (is_cancelled(slot.params) || slot.abandoned)
+    {
+        slot.done.set_value(generation_cancelled());
+        return;
+    }
+    fair_share_dispatch(slot.params.order);
+    if (deadline_unachievable(slot.params, slot.params.est_text_ms))
+    {
+        slot.done.set_value(generation_deadline());
+        return;
+    }
+    // a complete prompt is checked here, before it takes a sequence; one still waiting for an
+    // image was checked up to it by the request and is checked again once its sizes are known
+    if (slot.n_ready.load(std::memory_order_acquire) == slot.prompt.size() && prompt_positions(slot.prompt) >= engine.n_ctx_slot)
+    {
+        slot.done.set_value(generation_error("Error: Prompt does not fit the context"));
+        return;
     }
 
-    return decoded_string;
+    slot.seq = engine.free_seqs.back();
+    engine.free_seqs.pop_back();
+    slot.t_start = std::chrono::steady_clock::now();
+    engine.active.push_back(&slot);
+    if (!engine.running)
+    {
+        engine_run();
+    }
 }
 
-std::string generate_image_description(const std::string &image_data, const std::string &system_message, const std::string &user_message)
+// Queues the slot on the text lane, the future yields its result
+static std::future<generation_result> engine_submit(text_slot &slot)
 {
-    // Decode base64 image data
-    std::string decoded_image = base64_decode(image_data);
+    std::future<generation_result> result = slot.done.get_future();
+    lane_submit(text_lane, [&slot]()
+                { engine_admit(slot); }, slot.params.order);
+    return result;
+}
 
-    // Convert decoded image to OpenCV Mat
-    std::vector<uchar> image_vector(decoded_image.begin(), decoded_image.end());
-    cv::Mat image = cv::imdecode(image_vector, cv::IMREAD_COLOR);
+// Prefills the prompt and generates on the batch engine, blocks until the request is done
+generation_result generate_sequence(std::vector<prompt_segment> prompt, const generation_params &params)
+{
+    const size_t n_segments = prompt.size();
+    text_slot slot(std::move(prompt), params, n_segments);
+    return engine_submit(slot).get();
+}
 
-    if (image.empty())
+static void vision_set_abort_callback(struct clip_state *state, bool (*callback)(void *), void *data)
+{
+    if (state)
     {
-        return "Error: Failed to decode image";
+        clip_state_set_abort_callback(state, callback, data);
     }
+    else
+    {
+        clip_set_abort_callback(clip_ctx, callback, data);
+    }
+}
 
-    // Create clip_image_u8
-    struct clip_image_u8 *clip_image = clip_image_u8_init();
-    if (!clip_image)
+// Decodes the image files, any format OpenCV reads, into the RGB pixels CLIP expects,
+// skipping precomputed embeddings. Returns the 1-based number of the first image that fails
+// to decode, 0 when all of them did.
+static size_t decode_images(const std::vector<image_input> &images, std::vector<struct clip_image_u8 *> &clip_images)
+{
+    for (size_t i = 0; i < images.size(); i++)
     {
-        return "Error: Failed to initialize clip_image_u8";
+        if (images[i].precomputed())
+        {
+            continue;
+        }
+        trace_span span("decode", trace_request, -1, "bytes", (int64_t)images[i].bytes.size());
+        std::vector<uchar> image_vector(images[i].bytes.begin(), images[i].bytes.end());
+        cv::Mat image = cv::imdecode(image_vector, cv::IMREAD_COLOR);
+        if (image.empty())
+        {
+            free_images(clip_images);
+            return i + 1;
+        }
+        cv::Mat rgb;
+        cv::cvtColor(image, rgb, cv::COLOR_BGR2RGB);
+        clip_images.push_back(clip_image_u8_init());
+        clip_image_load_from_pixels(rgb.data, rgb.cols, rgb.rows, clip_images.back());
     }
+    return 0;
+}
 
-    // Convert OpenCV Mat to clip_image_u8
-    if (!clip_image_load_from_bytes(image.data, image.total() * image.elemSize(), clip_image))
+static void free_images(std::vector<struct clip_image_u8 *> &clip_images)
+{
+    for (struct clip_image_u8 *clip_image : clip_images)
     {
         clip_image_u8_free(clip_image);
-        return "Error: Failed to load image data into clip_image_u8";
     }
+    clip_images.clear();
+}
 
-    // Generate image embedding
-    float *image_embed = nullptr;
-    int n_img_pos = 0;
-    if (!llava_image_embed_make_with_clip_img(clip_ctx, std::thread::hardware_concurrency(), clip_image, &image_embed, &n_img_pos))
+image_embeddings::~image_embeddings()
+{
+    for (float *image_embd : embd)
     {
-        clip_image_u8_free(clip_image);
-        return "Error: Failed to generate image embedding";
+        free(image_embd);
     }
+}
 
-    // Prepare prompt
-    std::string prompt = system_message + "\n\nUser: " + user_message + "\n\nAssistant: ";
+// Encodes the images on the vision lane and waits for it: the tiles of all of them go through
+// CLIP together, --vision-batch per graph, on the clip_state of the worker that runs the job.
+// on_start runs on the vision lane right before CLIP does, not at all when the job is dropped.
+static bool encode_images(const std::vector<struct clip_image_u8 *> &clip_images, const generation_params &params, image_embeddings &out,
+                          const std::function<void()> &on_start)
+{
+    out.embd.assign(clip_images.size(), nullptr);
+    out.n_pos.assign(clip_images.size(), 0);
+    return lane_run(vision_lane, [&]()
+                    {
+        if (is_cancelled(params))
+        {
+            return false;
+        }
+        fair_share_dispatch(params.order);
+        if (deadline_unachievable(params, params.est_vision_ms + params.est_text_ms))
+        {
+            out.missed_deadline = true;
+            return false;
+        }
+        if (on_start)
+        {
+            on_start();
+        }
+        const auto t_start = std::chrono::steady_clock::now();
+        trace_request = params.request_id; // for the llava stage callback
+        struct clip_state *state = clip_states[lane_worker_index];
+        vision_set_abort_callback(state, abort_if_cancelled, (void *)params.cancel);
+        bool ok = llava_image_embed_make_batch_with_clip_img(clip_ctx, state, vision_lane.n_threads, clip_images.data(), clip_images.size(),
+                                                             clip_batch_max, out.embd.data(), out.n_pos.data());
+        vision_set_abort_callback(state, nullptr, nullptr);
+        out.vision_ms = ms_since(t_start);
+        return ok; }, params.order);
+}
 
-    // Tokenize the prompt
-    std::vector<llama_token> tokens(1024); // Pre-allocate space for tokens
-    int n_tokens = llama_tokenize(llama_model,
-                                  prompt.c_str(),
-                                  prompt.length(),
-                                  tokens.data(),
-                                  tokens.size(),
-                                  true,  // add_special
-                                  true); // parse_special
-    if (n_tokens < 0)
+generation_result generate_image_description(const std::vector<image_input> &images, const std::string &system_message, const std::vector<std::string> &user_texts, const generation_params &params)
+{
+    std::vector<struct clip_image_u8 *> clip_images;
+    if (size_t failed = decode_images(images, clip_images))
     {
-        clip_image_u8_free(clip_image);
-        free(image_embed);
-        return "Error: Failed to tokenize prompt";
+        return generation_error("Error: Failed to decode image " + std::to_string(failed));
     }
-    tokens.resize(n_tokens);
 
-    // Generate description
-    std::string description;
-    int n_past = 0;
+    std::vector<prompt_segment> segments;
+    if (!tokenize_image_prompt(system_message, user_texts, segments))
+    {
+        free_images(clip_images);
+        return generation_error("Error: Failed to tokenize prompt");
+    }
+
+    // The positions known so far, the text and the precomputed embeddings, have to fit before
+    // anything is prefilled; the encoded images are added once CLIP is done
+    int n_positions = prompt_positions(segments);
+    for (const image_input &image : images)
+    {
+        n_positions += image.precomputed() ? image.n_pos : 0;
+    }
+    if (n_positions >= engine.n_ctx_slot)
+    {
+        free_images(clip_images);
+        return generation_error("Error: Prompt does not fit the context");
+    }
 
-    // Create a named llava_image_embed object
-    llava_image_embed img_embed = {image_embed, n_img_pos};
+    // The text lane prefills the prompt up to the first image CLIP has to encode while the
+    // vision lane works on it, then each embedding takes its place in the prompt. Precomputed
+    // embeddings before that image are there from the start.
+    text_slot slot(std::move(segments), params, 1);
+    size_t n_provided = 0;
+    while (n_provided < images.size() && images[n_provided].precomputed())
+    {
+        engine_provide(slot, 2 * n_provided + 1, images[n_provided].embd.data(), images[n_provided].n_pos);
+        n_provided++;
+    }
 
-    // Use the address of the named object
-    llava_eval_image_embed(llama_ctx, &img_embed, 1, &n_past);
+    // With images to encode the slot is submitted when their vision job starts, so requests
+    // queued behind a busy vision lane hold no sequence that text-only requests could use
+    std::future<generation_result> description;
+    image_embeddings embeddings;
+    bool ok = true;
+    if (clip_images.empty())
+    {
+        description = engine_submit(slot);
+    }
+    else
+    {
+        ok = encode_images(clip_images, params, embeddings, [&]()
+                           { description = engine_submit(slot); });
+        free_images(clip_images);
+    }
+    for (size_t i = 0; ok && i < embeddings.n_pos.size(); i++)
+    {
+        n_positions += embeddings.n_pos[i];
+    }
+    const bool too_long = ok && n_positions >= engine.n_ctx_slot;
 
-    // Process tokens using indexing instead of range-based for loop
-    for (size_t i = 0; i < tokens.size(); ++i)
+    std::vector<int> image_tokens;
+    for (size_t i = 0, k = 0; ok && i < images.size(); i++)
     {
-        llama_batch batch = llama_batch_get_one(&tokens[i], 1, n_past, 0);
-        if (llama_decode(llama_ctx, batch))
+        const bool encoded = !images[i].precomputed();
+        const float *embd = encoded ? embeddings.embd[k] : images[i].embd.data();
+        const int n_pos = encoded ? embeddings.n_pos[k++] : images[i].n_pos;
+        if (i >= n_provided && !too_long && !is_cancelled(params))
         {
-            clip_image_u8_free(clip_image);
-            free(image_embed);
-            return "Error: Failed to decode tokens";
+            engine_provide(slot, 2 * i + 1, embd, n_pos);
         }
-        n_past++;
+        image_tokens.push_back(n_pos);
+    }
+    if (!description.valid())
+    {
+        // dropped before the vision job started, the slot never reached the engine
+        return is_cancelled(params) ? generation_cancelled() : embeddings.missed_deadline ? generation_deadline()
+                                                                                         : generation_error("Error: Failed to generate image embedding");
+    }
+    if (!ok || too_long || is_cancelled(params))
+    {
+        engine_abandon(slot);
     }
+    generation_result result = description.get();
 
-    llama_token id = 0;
-    char token_buf[8]; // Buffer to store the token piece, adjust size if needed
-    for (int i = 0; i < 500; ++i)
-    { // Generate up to 500 tokens
-        llama_token_data_array candidates = {NULL, 0, false};
-        id = llama_sample_token(llama_ctx, &candidates);
+    if (too_long)
+    {
+        return generation_error("Error: Prompt does not fit the context");
+    }
+    if (is_cancelled(params))
+    {
+        return generation_cancelled();
+    }
+    if (embeddings.missed_deadline)
+    {
+        return generation_deadline();
+    }
+    if (!ok)
+    {
+        return generation_error("Error: Failed to generate image embedding");
+    }
+    result.vision_ms = embeddings.vision_ms;
+    result.image_tokens = std::move(image_tokens);
+    result.images_encoded = embeddings.embd.size();
+    return result;
+}
 
-        if (llama_token_eos(llama_model) == id)
+// Prompt with images between the user's texts. Segment 2i holds the text before image i, the
+// first one also the system message and the opening of the user turn; segment 2i + 1 is left
+// for the image's embedding. The last segment closes the user turn.
+static bool tokenize_image_prompt(const std::string &system_message, const std::vector<std::string> &user_texts, std::vector<prompt_segment> &segments)
+{
+    const size_t n_texts = user_texts.size();
+    segments.assign(2 * n_texts - 1, prompt_segment());
+    for (size_t i = 0; i < n_texts; i++)
+    {
+        std::string text;
+        if (i == 0)
         {
-            break;
+            text = system_message + "\n\nUser: " + user_texts[0];
         }
-
-        int token_length = llama_token_to_piece(llama_model, id, token_buf, sizeof(token_buf), 0, false);
-        if (token_length > 0)
+        else if (!user_texts[i].empty() || i + 1 < n_texts)
         {
-            description.append(token_buf, token_length);
+            text = "\n" + user_texts[i]; // a line break after each image
+        }
+        if (i + 1 == n_texts)
+        {
+            text += "\n\nAssistant: ";
         }
 
-        llama_batch batch = llama_batch_get_one(&id, 1, n_past, 0);
-        if (llama_decode(llama_ctx, batch))
+        std::vector<llama_token> &tokens = segments[2 * i].tokens;
+        int n_tokens = -llama_tokenize(llama_model, text.c_str(), text.length(), nullptr, 0, i == 0, true);
+        tokens.resize(n_tokens);
+        if (n_tokens <= 0 || llama_tokenize(llama_model, text.c_str(), text.length(), tokens.data(), tokens.size(), i == 0, true) != n_tokens)
         {
-            break;
+            return false;
         }
-        n_past++;
     }
-
-    clip_image_u8_free(clip_image);
-    free(image_embed);
-    return description;
+    return true;
 }
 
-std::string generate_text_response(const std::string &system_message, const std::string &user_message)
+generation_result generate_text_response(const std::string &system_message, const std::string &user_message, const generation_params &params)
 {
     std::cout << "Entering generate_text_response" << std::endl;
 
@@ -464,101 +4074,63 @@ std::string generate_text_response(const std::string &system_message, const std:
     if (n_tokens < 0)
     {
         std::cerr << "Error: Failed to tokenize prompt" << std::endl;
-        return "Error: Failed to tokenize prompt";
+        return generation_error("Error: Failed to tokenize prompt");
     }
     tokens.resize(n_tokens);
     std::cout << "Tokenized " << n_tokens << " tokens" << std::endl;
 
     // Generate response
-    std::string response;
-    int n_past = 0;
+    std::vector<prompt_segment> segments(1);
+    segments[0].tokens = std::move(tokens);
+    generation_result response = generate_sequence(std::move(segments), params);
+
+    std::cout << "Generated response: " << response.text << std::endl;
+    return response;
+}
 
-    std::cout << "Starting token processing" << std::endl;
-    // Process prompt tokens
-    for (size_t i = 0; i < tokens.size(); i += 32)
+std::string utf8_assembler::push(const char *data, size_t len)
+{
+    pending.append(data, len);
+
+    // find the last lead byte and check whether its sequence is complete
+    size_t cut = pending.size();
+    for (size_t back = 1; back <= std::min<size_t>(4, pending.size()); back++)
     {
-        int batch_size = std::min(32, static_cast<int>(tokens.size() - i));
-        std::cout << "Processing token batch " << i << " to " << i + batch_size - 1 << std::endl;
-        llama_batch batch = llama_batch_get_one(&tokens[i], batch_size, n_past, 0);
-        if (llama_decode(llama_ctx, batch))
+        unsigned char c = pending[pending.size() - back];
+        if ((c & 0xC0) == 0x80)
+        {
+            continue; // continuation byte
+        }
+        size_t expected = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        if (back < expected)
         {
-            std::cerr << "Error: Failed to decode tokens at position " << i << std::endl;
-            return "Error: Failed to decode tokens";
+            cut = pending.size() - back;
         }
-        n_past += batch_size;
+        break;
     }
-    std::cout << "Finished token processing" << std::endl;
 
-    std::cout << "Starting text generation" << std::endl;
-
-    const int generate_max_tokens = 500;
-    const int batch_size = 32;  // Adjust based on your hardware capabilities
+    std::string complete = pending.substr(0, cut);
+    pending.erase(0, cut);
+    return complete;
+}
 
-    std::vector<llama_token> output_tokens;
-    output_tokens.reserve(generate_max_tokens);
+void build_piece_table(const struct llama_model *model)
+{
+    const int n_vocab = llama_n_vocab(model);
+    pieces.arena.clear();
+    pieces.offsets.assign(1, 0);
 
-    // Pre-allocate candidates array
-    const int n_vocab = llama_n_vocab(llama_model);
-    std::vector<llama_token_data> candidates_data(n_vocab);
-    llama_token_data_array candidates = { candidates_data.data(), candidates_data.size(), false };
-
-    for (int i = 0; i < generate_max_tokens; i += batch_size) {
-        std::cout << "Generating token batch " << i << " to " << i + batch_size - 1 << std::endl;
-        // Prepare the batch
-        llama_batch batch = llama_batch_init(batch_size, 0, 1);
-        int actual_batch_size = std::min(batch_size, generate_max_tokens - i);
-        
-        for (int j = 0; j < actual_batch_size; j++) {
-            if (j == 0 || output_tokens.empty()) {
-                // Sample a new token
-                const float* logits = llama_get_logits(llama_ctx);
-                for (int token_id = 0; token_id < n_vocab; token_id++) {
-                    candidates_data[token_id] = {
-                        token_id,
-                        logits[token_id],
-                        0.0f
-                    };
-                }
-                llama_token id = llama_sample_token(llama_ctx, &candidates);
-                
-                if (llama_token_eos(llama_model) == id) {
-                    std::cout << "EOS token encountered. Stopping generation." << std::endl;
-                    actual_batch_size = j;
-                    break;
-                }
-                output_tokens.push_back(id);
-            }
-            
-            llama_batch_add(batch, output_tokens.back(), n_past + j, {}, false);
-        }
-        
-        // Process the batch
-        if (llama_decode(llama_ctx, batch)) {
-            std::cerr << "Error: Failed to decode batch" << std::endl;
-            break;
-        }
-        
-        // Convert tokens to text
-        for (int j = 0; j < actual_batch_size; j++) {
-            char token_buf[8];
-            int token_length = llama_token_to_piece(llama_model, output_tokens[i+j], token_buf, sizeof(token_buf), 0, false);
-            if (token_length > 0) {
-                response.append(token_buf, token_length);
-            }
-            std::cout << "Generated token " << i+j << ": " << std::string(token_buf, token_length) << std::endl;
-        }
-        
-        n_past += actual_batch_size;
-        
-        // Check for context limit
-        if (llama_get_kv_cache_token_count(llama_ctx) >= llama_n_ctx(llama_ctx)) {
-            std::cout << "Context limit reached. Stopping generation." << std::endl;
-            break;
+    std::vector<char> buf(64);
+    for (llama_token id = 0; id < n_vocab; id++)
+    {
+        int n = llama_token_to_piece(model, id, buf.data(), buf.size(), 0, false);
+        if (n < 0)
+        {
+            buf.resize(-n);
+            n = llama_token_to_piece(model, id, buf.data(), buf.size(), 0, false);
         }
-
-        llama_batch_free(batch);
+        pieces.arena.append(buf.data(), std::max(0, n));
+        pieces.offsets.push_back(pieces.arena.size());
     }
-
-    std::cout << "Generated response: " << response << std::endl;
-    return response;
-}
\ No newline at end of file
+    std::cout << "Piece table: " << n_vocab << " tokens, " << pieces.arena.size() << " bytes" << std::endl;
+}
@@ -8,6 +8,7 @@
 #include <cstdlib>
 #include <vector>
 #include <numeric>
+#include <algorithm>
 
 // RGB uint8 image
 struct clip_image_u8 {
@@ -203,84 +204,116 @@ static bool clip_llava_handle_patches(clip_ctx * ctx_clip, std::vector<float *>
 }
 
 
-static bool encode_image_with_clip(clip_ctx * ctx_clip, int n_threads, const clip_image_u8 * img, float * image_embd, int * n_img_pos) {
-    // std::vector<clip_image_f32*> img_res_v; // format VectN x H x W x RGB (N x 336 x 336 x 3), so interleaved RGB - different to the python implementation which is N x 3 x 336 x 336
-    clip_image_f32_batch img_res_v;
-    img_res_v.size = 0;
-    img_res_v.data = nullptr;
-    if (!clip_image_preprocess(ctx_clip, img, &img_res_v)) {
-        LOG_TEE("%s: unable to preprocess image\n", __func__);
-        delete[] img_res_v.data;
-        return false;
-    }
+static llava_trace_callback trace_callback = NULL;
+static void * trace_user_data = NULL;
 
-    const int64_t t_img_enc_start_us = ggml_time_us();
+void llava_set_trace_callback(llava_trace_callback callback, void * user_data) {
+    trace_callback  = callback;
+    trace_user_data = user_data;
+}
+
+static void llava_trace(const char * stage, int index, int count, int64_t t_start_us) {
+    if (trace_callback) {
+        trace_callback(stage, index, count, ggml_time_us() - t_start_us, trace_user_data);
+    }
+}
 
+// Encodes several images at once: the tiles of all of them go through CLIP together, up to
+// max_batch per graph (0: all), and each image's embedding is put together from its tiles.
+// image_embds[i] is malloc'ed, clip_embd_nbytes per tile at most. state NULL: the ctx's own.
+static bool encode_images_with_clip(clip_ctx * ctx_clip, clip_state * state, int n_threads, const clip_image_u8 * const * imgs, int n_imgs, int max_batch, float ** image_embds, int * n_img_pos) {
     const char * mm_patch_merge_type = clip_patch_merge_type(ctx_clip);
+    const bool spatial_unpad = strcmp(mm_patch_merge_type, "spatial_unpad") == 0;
 
-    if (strcmp(mm_patch_merge_type, "spatial_unpad") != 0) {
-        // flat / default llava-1.5 type embedding
-        *n_img_pos = clip_n_patches(ctx_clip);
-        bool encoded = clip_image_encode(ctx_clip, n_threads, &img_res_v.data[0], image_embd); // image_embd shape is 576 x 4096
+    // format VectN x H x W x RGB (N x 336 x 336 x 3), so interleaved RGB - different to the python implementation which is N x 3 x 336 x 336
+    std::vector<clip_image_f32> tiles;
+    std::vector<size_t> first_tile(n_imgs + 1, 0);
+    for (int i = 0; i < n_imgs; i++) {
+        clip_image_f32_batch img_res_v;
+        img_res_v.size = 0;
+        img_res_v.data = nullptr;
+        const int64_t t_preprocess_start_us = ggml_time_us();
+        if (!clip_image_preprocess(ctx_clip, imgs[i], &img_res_v)) {
+            LOG_TEE("%s: unable to preprocess image %d\n", __func__, i);
+            delete[] img_res_v.data;
+            return false;
+        }
+        // flat / default llava-1.5 type embedding only uses the first tile
+        const size_t n_tiles = spatial_unpad ? img_res_v.size : 1;
+        for (size_t t = 0; t < n_tiles; t++) {
+            tiles.push_back(std::move(img_res_v.data[t]));
+        }
         delete[] img_res_v.data;
-        if (!encoded) {
-            LOG_TEE("Unable to encode image\n");
+        first_tile[i + 1] = tiles.size();
+        llava_trace("preprocess", i, (int) n_tiles, t_preprocess_start_us);
+    }
+
+    const int64_t t_img_enc_start_us = ggml_time_us();
 
+    const size_t n_tile_floats = clip_embd_nbytes(ctx_clip) / sizeof(float);
+    const size_t n_batch = max_batch > 0 ? max_batch : tiles.size();
+    std::vector<float> tile_embd(tiles.size() * n_tile_floats);
+    for (size_t t = 0; t < tiles.size(); t += n_batch) {
+        clip_image_f32_batch batch;
+        batch.data = &tiles[t];
+        batch.size = std::min(n_batch, tiles.size() - t);
+        float * batch_embd = tile_embd.data() + t * n_tile_floats;
+        const int64_t t_batch_start_us = ggml_time_us();
+        const bool encoded = state ? clip_image_batch_encode_with_state(ctx_clip, state, n_threads, &batch, batch_embd)
+                                   : clip_image_batch_encode(ctx_clip, n_threads, &batch, batch_embd);
+        if (!encoded) {
+            LOG_TEE("Unable to encode image tiles %d to %d of %d\n", (int) t+1, (int) (t+batch.size), (int) tiles.size());
             return false;
         }
-    } else {
-        // spatial_unpad llava-1.6 type embedding
-        // TODO: CLIP needs batching support - in HF the llm projection is separate after encoding, which might be a solution to quickly get batching working
-        std::vector<float *> image_embd_v;
-        image_embd_v.resize(img_res_v.size);
-        for (size_t i = 0; i < img_res_v.size; i++) {
-            image_embd_v[i] = (float *)malloc(clip_embd_nbytes(ctx_clip)); // 576 patches * 4096 embeddings * 4 bytes = 9437184
-            const bool encoded = clip_image_encode(ctx_clip, n_threads, &img_res_v.data[i], image_embd_v[i]); // image data is in 3x336x336 format and will be converted to 336x336x3 inside
-            if (!encoded) {
-                LOG_TEE("Unable to encode image - spatial_unpad - subimage %d of %d\n", (int) i+1, (int) img_res_v.size);
-                return false;
-            }
-        }
-        const int64_t t_img_enc_batch_us = ggml_time_us();
-        LOG_TEE("%s: %d segments encoded in %8.2f ms\n", __func__, (int)img_res_v.size, (t_img_enc_batch_us - t_img_enc_start_us) / 1000.0);
+        llava_trace("encode", (int) t, (int) batch.size, t_batch_start_us);
+    }
+    const int64_t t_img_enc_batch_us = ggml_time_us();
+    LOG_TEE("%s: %d segments of %d images encoded in %8.2f ms\n", __func__, (int)tiles.size(), n_imgs, (t_img_enc_batch_us - t_img_enc_start_us) / 1000.0);
 
+    std::vector<std::pair<int, int>> grid_pinpoints;
+    if (spatial_unpad) {
         const int32_t * image_grid = clip_image_grid(ctx_clip);
-
-        std::vector<std::pair<int, int>> grid_pinpoints;
         for (int i = 0; i < 32 && image_grid[i] != 0; i += 2) {
             grid_pinpoints.push_back({image_grid[i], image_grid[i+1]});
         }
+    }
+    const int32_t image_size = clip_image_size(ctx_clip);
 
-        // free all img_res_v - not needed anymore
-        delete[] img_res_v.data;
-        img_res_v.size = 0;
-        img_res_v.data = nullptr;
-
-        const int32_t image_size = clip_image_size(ctx_clip);
-
-        struct clip_image_grid_shape grid_shape = get_anyres_image_grid_shape({img->nx,img->ny}, grid_pinpoints, image_size);
+    for (int i = 0; i < n_imgs; i++) {
+        const size_t n_tiles = first_tile[i + 1] - first_tile[i];
+        float * image_tiles = tile_embd.data() + first_tile[i] * n_tile_floats;
 
-        int n_img_pos_out;
-        clip_llava_handle_patches(ctx_clip, image_embd_v, grid_shape, image_embd, &n_img_pos_out);
-        *n_img_pos = n_img_pos_out;
+        image_embds[i] = (float *)malloc(clip_embd_nbytes(ctx_clip) * n_tiles);
+        if (!image_embds[i]) {
+            LOG_TEE("Unable to allocate memory for image embeddings\n");
+            for (int j = 0; j < i; j++) {
+                free(image_embds[j]);
+            }
+            return false;
+        }
 
-        for (size_t i = 0; i < image_embd_v.size(); i++) {
-            free(image_embd_v[i]);
+        if (!spatial_unpad) {
+            memcpy(image_embds[i], image_tiles, clip_embd_nbytes(ctx_clip)); // image_embd shape is 576 x 4096
+            n_img_pos[i] = clip_n_patches(ctx_clip);
+        } else {
+            // spatial_unpad llava-1.6 type embedding
+            std::vector<float *> image_embd_v(n_tiles);
+            for (size_t t = 0; t < n_tiles; t++) {
+                image_embd_v[t] = image_tiles + t * n_tile_floats;
+            }
+            struct clip_image_grid_shape grid_shape = get_anyres_image_grid_shape({imgs[i]->nx, imgs[i]->ny}, grid_pinpoints, image_size);
+            const int64_t t_merge_start_us = ggml_time_us();
+            clip_llava_handle_patches(ctx_clip, image_embd_v, grid_shape, image_embds[i], &n_img_pos[i]);
+            llava_trace("merge", i, (int) n_tiles, t_merge_start_us);
         }
-        image_embd_v.clear();
 
-        // debug image/segment/normalization content:
-        // clip_image_u8 * tmp = clip_image_u8_init();
-        // clip_image_convert_f32_to_u8(*image_feature, *tmp);
-        // clip_image_save_to_bmp(*tmp, "image_feature.bmp");
+        LOG_TEE("%s: image embedding %d created: %d tokens\n", __func__, i, n_img_pos[i]);
     }
 
-    LOG_TEE("%s: image embedding created: %d tokens\n", __func__, *n_img_pos);
-
     const int64_t t_img_enc_end_us = ggml_time_us();
     float t_img_enc_ms = (t_img_enc_end_us - t_img_enc_start_us) / 1000.0;
 
-    LOG_TEE("\n%s: image encoded in %8.2f ms by CLIP (%8.2f ms per image patch)\n", __func__, t_img_enc_ms, t_img_enc_ms / *n_img_pos);
+    LOG_TEE("\n%s: %d images encoded in %8.2f ms by CLIP\n", __func__, n_imgs, t_img_enc_ms);
 
     return true;
 }
@@ -297,21 +330,14 @@ bool llava_validate_embed_size(const llama_context * ctx_llama, const clip_ctx *
 }
 
 bool llava_image_embed_make_with_clip_img(clip_ctx * ctx_clip, int n_threads, const clip_image_u8 * img, float ** image_embd_out, int * n_img_pos_out) {
-    float * image_embd = (float *)malloc(clip_embd_nbytes(ctx_clip)*6); // TODO: base on gridsize/llava model
-    if (!image_embd) {
-        LOG_TEE("Unable to allocate memory for image embeddings\n");
-        return false;
-    }
+    return llava_image_embed_make_batch_with_clip_img(ctx_clip, NULL, n_threads, &img, 1, 0, image_embd_out, n_img_pos_out);
+}
 
-    int n_img_pos;
-    if (!encode_image_with_clip(ctx_clip, n_threads, img, image_embd, &n_img_pos)) {
+bool llava_image_embed_make_batch_with_clip_img(clip_ctx * ctx_clip, clip_state * state, int n_threads, const clip_image_u8 * const * imgs, int n_imgs, int max_batch, float ** image_embd_out, int * n_img_pos_out) {
+    if (!encode_images_with_clip(ctx_clip, state, n_threads, imgs, n_imgs, max_batch, image_embd_out, n_img_pos_out)) {
         LOG_TEE("%s: cannot encode image, aborting\n", __func__);
-        free(image_embd);
         return false;
     }
-    *image_embd_out = image_embd;
-    *n_img_pos_out = n_img_pos;
-
     return true;
 }
 
@@ -357,6 +383,71 @@ struct llava_image_embed * llava_image_embed_make_with_bytes(struct clip_ctx * c
     return result;
 }
 
+struct llava_image_embed * llava_image_embeds_make_with_bytes(struct clip_ctx * ctx_clip, struct clip_state * state, int n_threads, const unsigned char * const * image_bytes, const int * image_bytes_length, int n_imgs, int max_batch) {
+    std::vector<clip_image_u8 *> imgs(n_imgs, nullptr);
+    auto free_imgs = [&imgs]() {
+        for (clip_image_u8 * img : imgs) {
+            if (img) {
+                clip_image_u8_free(img);
+            }
+        }
+    };
+    for (int i = 0; i < n_imgs; i++) {
+        imgs[i] = clip_image_u8_init();
+        if (!clip_image_load_from_bytes(image_bytes[i], image_bytes_length[i], imgs[i])) {
+            free_imgs();
+            LOG_TEE("%s: can't load image %d from bytes, is it a valid image?", __func__, i);
+            return NULL;
+        }
+    }
+
+    std::vector<float *> image_embds(n_imgs, nullptr);
+    std::vector<int> n_img_pos(n_imgs, 0);
+    const bool encoded = llava_image_embed_make_batch_with_clip_img(ctx_clip, state, n_threads, imgs.data(), n_imgs, max_batch, image_embds.data(), n_img_pos.data());
+    free_imgs();
+    if (!encoded) {
+        return NULL;
+    }
+
+    auto result = (llava_image_embed*)malloc(n_imgs * sizeof(llava_image_embed));
+    if (!result) {
+        for (float * embd : image_embds) {
+            free(embd);
+        }
+        LOG_TEE("%s: unable to allocate the embeddings of %d images\n", __func__, n_imgs);
+        return NULL;
+    }
+    for (int i = 0; i < n_imgs; i++) {
+        result[i].embed = image_embds[i];
+        result[i].n_image_pos = n_img_pos[i];
+    }
+    return result;
+}
+
+void llava_image_embeds_free(struct llava_image_embed * embeds, int n_imgs) {
+    for (int i = 0; i < n_imgs; i++) {
+        free(embeds[i].embed);
+    }
+    free(embeds);
+}
+
+void llava_image_embed_pool_mean(struct llava_image_embed * embed, int n_embd) {
+    if (embed->n_image_pos <= 1) {
+        return;
+    }
+    // row 0 accumulates in place, the other rows are left as they are
+    for (int pos = 1; pos < embed->n_image_pos; pos++) {
+        const float * row = embed->embed + (size_t) pos * n_embd;
+        for (int i = 0; i < n_embd; i++) {
+            embed->embed[i] += row[i];
+        }
+    }
+    for (int i = 0; i < n_embd; i++) {
+        embed->embed[i] /= embed->n_image_pos;
+    }
+    embed->n_image_pos = 1;
+}
+
 static bool load_file_to_bytes(const char* path, unsigned char** bytesOut, long *sizeOut) {
     auto file = fopen(path, "rb");
     if (file == NULL) {
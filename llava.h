@@ -18,6 +18,7 @@
 #endif
 
 struct clip_ctx;
+struct clip_state;
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,13 +29,25 @@ struct llava_image_embed {
     int n_image_pos;
 };
 
+/** called on the encoding thread at the end of each stage of llava_image_embed_make_batch_with_clip_img with the stage's wall time: "preprocess" per image (index: the image), "encode" per CLIP graph (index: its first tile, count: its tiles), "merge" per LLaVA-1.6 image (index: the image) */
+typedef void (*llava_trace_callback)(const char * stage, int index, int count, int64_t duration_us, void * user_data);
+/** process wide, set before encoding; NULL turns it off */
+LLAVA_API void llava_set_trace_callback(llava_trace_callback callback, void * user_data);
+
 /** sanity check for clip <-> llava embed size match */
 LLAVA_API bool llava_validate_embed_size(const struct llama_context * ctx_llama, const struct clip_ctx * ctx_clip);
 
 LLAVA_API bool llava_image_embed_make_with_clip_img(struct clip_ctx * ctx_clip, int n_threads, const struct clip_image_u8 * img, float ** image_embd_out, int * n_img_pos_out);
+/** build the embeds of n_imgs images together: the CLIP tiles of all of them are encoded in batches of up to max_batch tiles (0: all at once). image_embd_out and n_img_pos_out get one entry per image, each embedding is malloc'ed. state is the worker's clip_state, NULL for the ctx's own */
+LLAVA_API bool llava_image_embed_make_batch_with_clip_img(struct clip_ctx * ctx_clip, struct clip_state * state, int n_threads, const struct clip_image_u8 * const * imgs, int n_imgs, int max_batch, float ** image_embd_out, int * n_img_pos_out);
 
 /** build an image embed from image file bytes */
 LLAVA_API struct llava_image_embed * llava_image_embed_make_with_bytes(struct clip_ctx * ctx_clip, int n_threads, const unsigned char * image_bytes, int image_bytes_length);
+/** build the embeds of n_imgs images from their file bytes in one batched CLIP pass (see llava_image_embed_make_batch_with_clip_img), free with llava_image_embeds_free */
+LLAVA_API struct llava_image_embed * llava_image_embeds_make_with_bytes(struct clip_ctx * ctx_clip, struct clip_state * state, int n_threads, const unsigned char * const * image_bytes, const int * image_bytes_length, int n_imgs, int max_batch);
+LLAVA_API void llava_image_embeds_free(struct llava_image_embed * embeds, int n_imgs);
+/** average embed over its positions in place, leaving a single position of n_embd floats */
+LLAVA_API void llava_image_embed_pool_mean(struct llava_image_embed * embed, int n_embd);
 /** build an image embed from a path to an image filename */
 LLAVA_API struct llava_image_embed * llava_image_embed_make_with_filename(struct clip_ctx * ctx_clip, int n_threads, const char * image_path);
 LLAVA_API void llava_image_embed_free(struct llava_image_embed * embed);
@@ -1,6 +1,16 @@
 import requests
 import base64
 import json
+import os
+import subprocess
+import tempfile
+import struct
+import socket
+import time
+from urllib.parse import urlparse
+
+# Checks against a running llava-server. LLAVA_SERVER overrides the address.
+SERVER_URL = os.environ.get("LLAVA_SERVER", "http://192.168.0.213:8080")
 
 def encode_image(image_path):
     with open(image_path, "rb") as image_file:
@@ -8,11 +18,11 @@ def encode_image(image_path):
 
 def get_image_description(image_path):
     base64_image = encode_image(image_path)
-    
+
     headers = {
         'Content-Type': 'application/json',
     }
-    
+
     data = {
         "messages": [
             {
@@ -36,14 +46,282 @@ def get_image_description(image_path):
         "max_tokens": 500,
     }
 
-    response = requests.post('http://192.168.0.213:8080', headers=headers, json=data)
-    
+    response = requests.post(SERVER_URL, headers=headers, json=data)
+
     if response.status_code == 200:
         return response.json()['choices'][0]['message']['content']
     else:
         return f"Error: {response.status_code} - {response.text}"
 
+def text_request(prompt, **options):
+    data = {
+        "messages": [{"role": "user", "content": prompt}],
+        "model": "llava",
+        "max_tokens": 32,
+    }
+    data.update(options)
+    return data
+
+def complete(data):
+    response = requests.post(SERVER_URL, json=data)
+    assert response.status_code == 200, f"{response.status_code} - {response.text}"
+    return response.json()
+
+# Samplers: a fixed seed gives the same text, greedy decoding ignores the seed
+def test_sampling():
+    prompt = "Write a short poem about the sea."
+    first = complete(text_request(prompt, temperature=0.8, top_k=40, top_p=0.9, seed=1234))
+    second = complete(text_request(prompt, temperature=0.8, top_k=40, top_p=0.9, seed=1234))
+    assert first['choices'][0]['message']['content'] == second['choices'][0]['message']['content']
+
+    greedy = [complete(text_request(prompt, temperature=0, seed=seed)) for seed in (1, 2)]
+    assert greedy[0]['choices'][0]['message']['content'] == greedy[1]['choices'][0]['message']['content']
+
+    usage = first['usage']
+    assert usage['total_tokens'] == usage['prompt_tokens'] + usage['completion_tokens']
+    print("sampling: ok")
+
+# max_tokens bounds the output, a stop sequence cuts it before its first occurrence
+def test_stop_and_max_tokens():
+    prompt = "Count from one to twenty in words, separated by commas."
+    limited = complete(text_request(prompt, temperature=0, max_tokens=5))
+    assert limited['usage']['completion_tokens'] <= 5
+    assert limited['choices'][0]['finish_reason'] == "length"
+
+    full = complete(text_request(prompt, temperature=0, max_tokens=64))['choices'][0]['message']['content']
+    if len(full) < 8:
+        print("stop: skipped, output too short")
+        return
+    stop = full[len(full) // 2:len(full) // 2 + 3]
+    stopped = complete(text_request(prompt, temperature=0, max_tokens=64, stop=["<never-generated>", stop]))
+    assert stopped['choices'][0]['finish_reason'] == "stop"
+    assert stopped['choices'][0]['message']['content'] == full[:full.find(stop)]
+    print("stop and max_tokens: ok")
+
+# An unknown priority class is rejected; the echoed value can not break the JSON body
+def test_priority_validation():
+    for headers, options in (({"X-Priority": 'x", "injected": "1'}, {}), ({}, {"priority": "urgent\\"})):
+        response = requests.post(SERVER_URL, headers=headers, json=text_request("Say hello.", **options))
+        assert response.status_code == 400 and set(response.json()) == {"error"}
+    print("priority validation: ok")
+
+def stream_events(data):
+    response = requests.post(SERVER_URL, json=dict(data, stream=True), stream=True)
+    assert response.status_code == 200, f"{response.status_code} - {response.text}"
+    events = []
+    for line in response.iter_lines():
+        if not line.startswith(b"data: "):
+            continue
+        payload = line[len(b"data: "):]
+        if payload == b"[DONE]":
+            break
+        events.append(json.loads(payload.decode('utf-8')))  # strict: every chunk is valid UTF-8
+    return events
+
+# Streamed deltas are whole UTF-8 characters and add up to the non-streamed text; a failed
+# generation ends with its error message
+def test_streaming():
+    data = text_request("Reply with a few emoji and accented words like café or naïve.", temperature=0, max_tokens=48)
+    expected = complete(data)['choices'][0]['message']['content']
+    events = stream_events(data)
+    deltas = [event['choices'][0]['delta'].get('content', "") for event in events]
+    assert all('\ufffd' not in delta for delta in deltas)
+    assert "".join(deltas) == expected
+    assert events[-1]['choices'][0]['finish_reason'] in ("stop", "length")
+
+    too_long = text_request("word " * 100000, max_tokens=8)
+    events = stream_events(too_long)
+    assert events[-1]['choices'][0]['finish_reason'] == "error"
+    assert events[-1]['error']['message']
+    print("streaming: ok")
+
+def metric(name):
+    for line in requests.get(SERVER_URL + "/metrics").text.splitlines():
+        if line.startswith(name + " "):
+            return float(line.split()[1])
+    raise AssertionError(f"{name} missing from /metrics")
+
+def wait_for_metric(name, above, timeout_s=60):
+    deadline = time.time() + timeout_s
+    while time.time() < deadline:
+        if metric(name) > above:
+            return True
+        time.sleep(0.5)
+    return False
+
+def send_raw_request(data):
+    body = json.dumps(data).encode('utf-8')
+    url = urlparse(SERVER_URL)
+    sock = socket.create_connection((url.hostname, url.port or 80), timeout=120)
+    sock.sendall(b"POST / HTTP/1.1\r\nHost: " + url.hostname.encode() + b"\r\nContent-Type: application/json\r\n" +
+                 b"Content-Length: " + str(len(body)).encode() + b"\r\n\r\n" + body)
+    return sock
+
+# A non-streaming client that gives up mid-generation gets its request cancelled
+def test_disconnect_cancels():
+    before = metric("llava_requests_cancelled_total")
+    sock = send_raw_request(text_request("Tell a very long story about a lighthouse keeper.", max_tokens=2000))
+    time.sleep(2)  # generating by now
+    sock.close()
+    assert wait_for_metric("llava_requests_cancelled_total", before)
+    print("disconnect: ok")
+
+# A half-closed client (shutdown(SHUT_WR) after the body) is cancelled like a closed one,
+# unless the server runs with --allow-half-close; set LLAVA_ALLOW_HALF_CLOSE=1 then
+def test_half_close():
+    allowed = os.environ.get("LLAVA_ALLOW_HALF_CLOSE") == "1"
+    before = metric("llava_requests_cancelled_total")
+    with send_raw_request(text_request("Tell a long story.", temperature=0, max_tokens=200)) as sock:
+        sock.shutdown(socket.SHUT_WR)
+        reply = b""
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            reply += chunk
+    if allowed:
+        assert reply.startswith(b"HTTP/1.1 200"), reply[:200]
+        assert metric("llava_requests_cancelled_total") == before
+    else:
+        assert wait_for_metric("llava_requests_cancelled_total", before)
+    print("half-close: ok")
+
+def embed_images(image_path, **options):
+    data = {"input": [f"data:image/jpeg;base64,{encode_image(image_path)}"]}
+    data.update(options)
+    return requests.post(SERVER_URL + "/v1/images/embeddings", json=data)
+
+# Embeddings: base64 f16 of n_pos x n_embd values, mean pooling leaves one position, the
+# binary format carries the same shape
+def test_image_embeddings(image_path):
+    response = embed_images(image_path, pooling="none")
+    assert response.status_code == 200, f"{response.status_code} - {response.text}"
+    result = response.json()
+    assert result['object'] == "list" and len(result['mmproj_fingerprint']) == 16
+    entry = result['data'][0]
+    assert len(base64.b64decode(entry['embedding'])) == entry['n_pos'] * entry['n_embd'] * 2
+    assert result['usage']['image_tokens'] == entry['n_pos']
+
+    pooled = embed_images(image_path).json()['data'][0]
+    assert pooled['n_pos'] == 1 and pooled['n_embd'] == entry['n_embd']
+
+    binary = embed_images(image_path, pooling="none", encoding_format="binary")
+    assert binary.headers['X-Mmproj-Fingerprint'] == result['mmproj_fingerprint']
+    n_pos, n_embd = struct.unpack("<ii", binary.content[:8])
+    assert (n_pos, n_embd) == (entry['n_pos'], entry['n_embd'])
+    assert len(binary.content) == 8 + n_pos * n_embd * 2
+
+    assert embed_images(image_path, pooling="max").status_code == 400
+    for bad in ({"pooling": 1}, {"encoding_format": ["binary"]}, {"pooling": 'x", "injected": "1'}):
+        response = embed_images(image_path, **bad)
+        assert response.status_code == 400 and set(response.json()) == {"error"}
+    print("image embeddings: ok")
+
+# An embedding from the embeddings endpoint takes the image's place in a chat request; one
+# made with another projector is rejected
+def test_precomputed_embedding(image_path):
+    result = embed_images(image_path, pooling="none").json()
+    embedding = dict(result['data'][0], mmproj_fingerprint=result['mmproj_fingerprint'])
+    data = {
+        "messages": [
+            {
+                "role": "user",
+                "content": [
+                    {"type": "text", "text": "What's in this image?"},
+                    {"type": "image_embedding", "image_embedding": embedding},
+                ],
+            }
+        ],
+        "model": "llava",
+        "max_tokens": 16,
+    }
+    response = complete(data)
+    assert response['usage']['image_tokens'] == [embedding['n_pos']]
+
+    data['messages'][0]['content'][1]['image_embedding'] = dict(embedding, mmproj_fingerprint="0" * 16)
+    assert requests.post(SERVER_URL, json=data).status_code == 400
+    print("precomputed embedding: ok")
+
+# llava-batch resume: answered ids are skipped, failed ones run again and keep one line, a
+# line cut short by an interruption is dropped. Needs LLAVA_BATCH (the binary), LLAVA_MODEL
+# and LLAVA_MMPROJ.
+def test_batch_resume():
+    binary, model, mmproj = (os.environ.get(name) for name in ("LLAVA_BATCH", "LLAVA_MODEL", "LLAVA_MMPROJ"))
+    if not (binary and model and mmproj):
+        print("batch resume: skipped, set LLAVA_BATCH, LLAVA_MODEL and LLAVA_MMPROJ")
+        return
+    with tempfile.TemporaryDirectory() as tmp:
+        input_path = os.path.join(tmp, "requests.jsonl")
+        output_path = os.path.join(tmp, "results.jsonl")
+        with open(input_path, "w") as f:
+            for custom_id in ("done", "failed", "new"):
+                f.write(json.dumps({"custom_id": custom_id, "body": text_request("Say hello.", max_tokens=4)}) + "\n")
+        with open(output_path, "w") as f:
+            f.write(json.dumps({"id": "done", "response": {"object": "chat.completion"}}) + "\n")
+            f.write(json.dumps({"id": "failed", "error": "earlier failure"}) + "\n")
+            f.write('{"id": "new", "resp')  # interrupted mid-line
+
+        subprocess.run([binary, "--model", model, "--mmproj", mmproj, "--input", input_path, "--output", output_path], check=True)
+
+        with open(output_path) as f:
+            results = [json.loads(line) for line in f]
+    ids = sorted(result['id'] for result in results)
+    assert ids == ["done", "failed", "new"], ids
+    assert all('response' in result for result in results)
+    print("batch resume: ok")
+
+# /debug/clip-profile shape; the blocks are filled when the server runs with --clip-profile
+def test_clip_profile():
+    profile = requests.get(SERVER_URL + "/debug/clip-profile").json()
+    assert set(profile) == {"encodes", "total_ms", "blocks"}
+    for block in profile['blocks']:
+        assert set(block) == {"name", "calls", "total_ms", "mean_ms", "max_ms", "share"}
+        assert 0 <= block['share'] <= 1 and block['max_ms'] <= block['total_ms'] + 1e-6
+    if profile['blocks']:
+        names = [block['name'] for block in profile['blocks']]
+        assert names[0].startswith("patch_embd") and any(name.startswith("projector") for name in names)
+
+    assert requests.delete(SERVER_URL + "/debug/clip-profile").status_code == 204
+    assert requests.get(SERVER_URL + "/debug/clip-profile").json()['encodes'] == 0
+    print("clip profile: ok")
+
+# /debug/trace is Chrome trace-event JSON when the server runs with --trace, 404 otherwise.
+# Every span of an image request is tagged with its request id, the image decode included.
+def test_trace(image_path):
+    response = requests.get(SERVER_URL + "/debug/trace")
+    if response.status_code == 404:
+        print("trace: skipped, start the server with --trace")
+        return
+    get_image_description(image_path)
+    events = requests.get(SERVER_URL + "/debug/trace").json()['traceEvents']
+    spans = [event for event in events if event['ph'] == "X"]
+    for event in spans:
+        assert {"name", "pid", "tid", "ts", "dur", "args"} <= set(event) and event['dur'] >= 0
+        assert "request" in event['args']
+    named = {event['tid'] for event in events if event['ph'] == "M" and event['name'] == "thread_name"}
+    assert {event['tid'] for event in spans} <= named
+
+    names = {event['name'] for event in spans}
+    assert {"accept", "parse", "base64", "decode", "preprocess", "encode", "send"} <= names, names
+    assert names & {"prefill-chunk", "decode-step"}
+    decode = [event for event in spans if event['name'] == "decode"][-1]
+    assert decode['args']['request'] != 0
+    assert any(event['name'] == "encode" and event['args']['request'] == decode['args']['request'] for event in spans)
+    print("trace: ok")
+
 # Test the server
 image_path = './test.jpg'
 description = get_image_description(image_path)
-print(f"Image description: {description}")
\ No newline at end of file
+print(f"Image description: {description}")
+
+test_sampling()
+test_stop_and_max_tokens()
+test_priority_validation()
+test_streaming()
+test_disconnect_cancels()
+test_half_close()
+test_image_embeddings(image_path)
+test_precomputed_embedding(image_path)
+test_batch_resume()
+test_clip_profile()
+test_trace(image_path)